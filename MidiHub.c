@@ -61,10 +61,51 @@ typedef unsigned char byte;
 // MACRO DEFS
 //
 
+// build variants. Parts of the firmware that a unit does not
+// need can be left out, so their checks cost nothing in the
+// ISR or the main loop. Each FEATURE_ can be set to 0 or 1 at
+// build time, or THRU_ONLY or CLOCK_ONLY picks a preset
+// 	FEATURE_CLOCK	beat clock, external clock slave, clock ratio
+// 					and swing. Without it the hub stays in 
+// 					split-only mode
+// 	FEATURE_TAP		tap tempo mode (needs FEATURE_CLOCK)
+// 	FEATURE_ANIMATE	LED animation from thru traffic and the rate
+// 					meter in split-only mode
+// 	FEATURE_MENU	options menu and error counter display. Without
+// 					it the options are the ones saved in EEPROM
+// When none of them need the LEDs, the LED refresh is left out
+// too and LED 0 is just lit to show the power is on
+#ifdef THRU_ONLY
+#define FEATURE_CLOCK	0
+#define FEATURE_TAP		0
+#define FEATURE_ANIMATE	0
+#define FEATURE_MENU	0
+#endif
+#ifdef CLOCK_ONLY
+#define FEATURE_ANIMATE	0
+#endif
+#ifndef FEATURE_CLOCK
+#define FEATURE_CLOCK	1
+#endif
+#ifndef FEATURE_TAP
+#define FEATURE_TAP		FEATURE_CLOCK
+#endif
+#ifndef FEATURE_ANIMATE
+#define FEATURE_ANIMATE	1
+#endif
+#ifndef FEATURE_MENU
+#define FEATURE_MENU	1
+#endif
+#if FEATURE_TAP && !FEATURE_CLOCK
+#error FEATURE_TAP needs FEATURE_CLOCK
+#endif
+#define FEATURE_LEDS	(FEATURE_CLOCK || FEATURE_ANIMATE || FEATURE_MENU)
+
 // inputs
 #define P_RUN		portc.3
 #define P_DEC		porta.4
 #define P_INC		porta.5
+#define P_MIDI2		porta.3	// second MIDI input (software UART)
 
 // outputs
 #define P_LED0		portc.0 
@@ -87,6 +128,16 @@ typedef unsigned char byte;
 #define MIDI_SYNCH_CONTINUE 	0xfb
 #define MIDI_SYNCH_STOP     	0xfc
 
+// Sysex messages addressed to the hub itself are
+// F0 7D 48 <command> [<data>...] F7
+#define SYSEX_MANUFACTURER		0x7d	// non-commercial ID
+#define SYSEX_DEVICE			0x48
+#define SYSEX_CMD_INSTR_DUMP	0x01	// request instrumentation statistics
+#define SYSEX_CMD_INSTR_RESET	0x02	// reset instrumentation statistics
+#define SYSEX_CMD_FILTER		0x03	// set message filter for a status type
+#define SYSEX_CMD_FILTER_RESET	0x04	// pass all messages
+#define SYSEX_CMD_RATE_QUERY	0x05	// request traffic rates
+
 // Auto repeat delays 
 #define AUTO_REPEAT_INTERVAL	80
 #define AUTO_REPEAT_DELAY	 	500
@@ -94,44 +145,338 @@ typedef unsigned char byte;
 // Key debounce period 
 #define DEBOUNCE_PERIOD			100
 
+// Tap tempo entry ends this long after the last tap
+#define TAP_TIMEOUT				1000
+
+// Selected menu item flashes on for a short time in each cycle
+#define MENU_FLASH_ON			50
+#define MENU_FLASH_OFF			750
+
+// Version is shown for this long when RUN is held at power up
+#define VERSION_DISPLAY_TIME	5000
+
 // PWM fade stuff
 #define FADE_PERIOD				30
-#define PWM_DIM 				5
-#define PWM_MAX 				50
+#define PWM_DIM 				6
+#define PWM_MAX 				63	// duty values are 6 bits
 #define INITIAL_DUTY			10
+#define LED_PLANE_SHIFT			2	// the lowest bit of the LED duty is shown
+									// for 4 timer 2 counts (64us). The full 
+									// 6 bit cycle then takes about 4ms
 
-#define TIMER_0_INIT_SCALAR		5	// Timer 0 is an 8 bit timer counting at 250kHz
-									// using this init scalar means that rollover
+#define TIMER_0_INIT_SCALAR		6	// Timer 0 is an 8 bit timer counting at 250kHz
+									// adding this init scalar at each rollover 
+									// leaves 250 counts (6..255), so the rollover
 									// interrupt fires once per ms
 
-// Tempo defs
-#define BPM_MIN					30
-#define BPM_MAX					300
-#define BPM_DEFAULT				120
+// Tempo defs (in tenths of a BPM)
+#define BPM_MIN					300
+#define BPM_MAX					3000
+#define BPM_DEFAULT				1200
+#define BPM_STEP				10
+#define BPM_FINE_STEP			1
 
-// EEPROM usage
+// EEPROM usage. Settings are saved as a record to the next
+// slot of a ring, with a sequence number so that we can find 
+// the latest one. Addresses 9-13 are where older firmware 
+// kept the options, and are only read if there are no records
 #define EEPROM_ADDR_MAGIC_COOKIE 9
 #define EEPROM_ADDR_OPTIONS	10
+#define EEPROM_ADDR_OPTIONS2	11
+#define EEPROM_ADDR_MAGIC_COOKIE2 12
+#define EEPROM_ADDR_CLOCK_RATIO 13
 #define EEPROM_MAGIC_COOKIE 0xA5
+#define EEPROM_ADDR_SLOTS		16
+#define EEPROM_NUM_SLOTS		16
+#define SZ_SETTINGS				8	// bytes in each record
+#define EEPROM_ADDR_FILTER		(EEPROM_ADDR_SLOTS + EEPROM_NUM_SLOTS * SZ_SETTINGS)
+												// two copies of the filter table, 
+												// used by odd and even slots
+#define SAVE_DELAY				2000 // ms since last change before saving
 
-// Menu size
-#define MENU_SIZE 6 
+// Menu size (items 0-5 are on the first page, 6-11 are on
+// the second page and 12 onwards on the third)
+#define MENU_SIZE 15 
+#define MENU_ITEM_BRIGHTNESS 5
+#define MENU_ITEM_CLOCK_RATIO 10
+#define MENU_ITEM_SWING 11
+#define MENU_ITEM_RATEMETER 12
+#define MENU_ITEM_BAR_LENGTH 13
+#define MENU_ITEM_CLOCK_OFFSET 14
 
 //
 // GLOBAL DATA
 //
 
 // timer stuff
-volatile byte tick_flag = 0;
-volatile unsigned int timer_init_scalar = 0;
+volatile byte ticksPending = 0;	// ticks the main loop has not seen yet
+volatile byte tickCount = 0;	// MIDI clock ticks 0-23 in the current beat
+volatile byte running = 0;		// set when the clock is being sent
+volatile byte midiRestart = 0;	// set to send START at the next bar
+#if FEATURE_CLOCK
+byte runLock = 0;				// set when RUN restarts instead of stopping
+#endif
+
+// bars and song position. The beat in the bar is counted 
+// along with the tick, and while running the song position 
+// is counted in 16th notes (6 ticks) as used by MIDI song 
+// position pointer. With a bar longer than one beat, starting
+// and stopping wait for the start of the next bar
+#define NUM_BAR_LENGTHS 6		// 1 to 6 beats
+byte _barLength = 1;
+#if FEATURE_CLOCK
+enum {
+	RUN_REQUEST_NONE,
+	RUN_REQUEST_START,	// START (or CONTINUE) at the next bar
+	RUN_REQUEST_STOP	// STOP at the next bar
+};
+volatile byte runRequest = RUN_REQUEST_NONE;
+volatile byte barBeat = 0;				// beat 0..(_barLength-1) in the bar
+volatile unsigned int songPosition = 0;	// 16ths since START
+volatile byte positionTicks = 0;		// ticks into the current 16th
+volatile byte resumeTick = 0;			// tickCount and barBeat to carry
+volatile byte resumeBeat = 0;			// on from songPosition
+volatile byte sppPending = 0;	// set to send our song position between messages
+volatile byte sppWait = 0;		// set until it has been sent..
+volatile byte sppTxEnd = 0;		// ..which is when txTail reaches here
+volatile byte txHold = 0;		// START goes out with the next tick..
+byte sppInIndex = 0;			// data bytes of an incoming pointer
+byte sppInLo = 0;
+#define TX_HOLD_COUNTS	320		// ..so hold the thru for the last 640us of this one
+#define TX_HELD() isrTxHeld()
+#else
+#define TX_HELD() 0
+#endif
+
+#if FEATURE_CLOCK
+// timer 1 counts per MIDI tick are tickPeriod + tickPeriodRem/tickPeriodDiv.
+// The ISR adds the remainder into tickPhase on every tick and stretches
+// the tick by one count each time it overflows, so the fractional part 
+// is spread across the ticks instead of being lost
+volatile unsigned int tickPeriod = 0;
+volatile unsigned int tickPeriodRem = 0;
+volatile unsigned int tickPeriodDiv = 1;
+volatile unsigned int tickPhase = 0;
+#endif
+
+// read the running timer 1 count (2us per count), which starts
+// from zero at each tempo tick
+#define READ_TIMER1(v) { byte h = tmr1h; byte l = tmr1l; if(tmr1h != h) { h = tmr1h; l = tmr1l; } (v) = ((unsigned int)h << 8) | l; }
+
+#if FEATURE_CLOCK
+// external clock slave. The incoming clock steers the tick 
+// period through a phase locked loop, so the clock we send 
+// is a smoothed copy of it
+#define SLAVE_ACQUIRE_SHIFT		3	// average 8 intervals to find the tempo
+#define SLAVE_ACQUIRE_TICKS		(1 << SLAVE_ACQUIRE_SHIFT)
+#define SLAVE_FAST_TICKS		48	// ticks using the fast loop gains
+#define SLAVE_TIMEOUT			250	// ms without a tick before giving up
+#define SLAVE_MIN_PERIOD		2000 // shortest tick we'll follow (625BPM)
+enum {
+	SLAVE_IDLE,		// no external clock
+	SLAVE_ACQUIRE,	// measuring the external clock tempo
+	SLAVE_LOCKED	// following the external clock
+};
+volatile byte slaveState = SLAVE_IDLE;
+volatile byte slaveCount = 0;			// ticks counted in the current state
+volatile signed char slaveTickDiff = 0;	// our ticks minus incoming ticks
+volatile unsigned long slavePeriod = 0;	// filtered period, timer counts x 256
+volatile int slaveAdjust = 0;			// one-off adjustment to next period
+volatile byte slaveTimeout = 0;			// ms before we stop following the clock
+volatile int slaveOffset = 0;			// timer counts to lead the external clock by
+volatile byte slavePeriodNew = 0;		// set when slavePeriod has changed
+#endif
+
+// clock offset when following an external clock, in steps of
+// one MIDI byte time (about what each hub in a chain adds). A
+// positive offset sends our ticks ahead of the incoming ones
+// and a negative one sends them late
+#define CLOCK_OFFSET_MIN		-2
+#define CLOCK_OFFSET_MAX		3
+#define CLOCK_OFFSET_STEP		160	// 320us in timer 1 counts
+signed char _clockOffset = 0;
+
+#if FEATURE_TAP
+// tap tempo. The taps are timed to 4us from timer 0 and a
+// short history of intervals is kept so that one bad tap 
+// can be rejected or trimmed out
+#define SZ_TAPHISTORY 8 // must be power of 2
+#define TAP_TOLERANCE_SHIFT 2 // reject intervals more than 1/4 out
+#define TAP_AGREE_SHIFT 3 // two rejects within 1/8 of each other are a new tempo
+unsigned long tapHistory[SZ_TAPHISTORY];
+byte tapHistoryCount = 0;
+byte tapHistoryPos = 0;
+unsigned long tapOutlier = 0;	// last interval rejected, 0 if none
+byte tapMerged = 0;				// last interval was two put back together
+unsigned long tapEstimate = 0;
+
+// the ISR timestamps the DEC button press as it happens, so the
+// main loop being busy doesn't wobble the tap intervals
+enum {
+	TAP_STAMP_IDLE,		// taken by the main loop
+	TAP_STAMP_ARMED,	// DEC is up, waiting for the next press
+	TAP_STAMP_LATCHED	// timestamp of the press is ready
+};
+volatile byte tapStampState = TAP_STAMP_ARMED;
+volatile unsigned long tapStampTicks = 0;
+volatile byte tapStampT0 = 0;
+#endif
 volatile unsigned long systemTicks = 0; // each system tick is 1ms
 
-// define the buffer used to receive MIDI input
-#define SZ_RXBUFFER 20
+// Software timers. Each one counts down in ms from the main 
+// loop (keeping the work out of the ISR) and clears its bit in
+// timerActive when it runs out, so the rest of the main loop
+// only needs to test a bit to see if it is due
+enum {
+	TIMER_DEBOUNCE,		// ignore buttons after a change
+	TIMER_REPEAT,		// long press and auto repeat
+	TIMER_FADE,			// LED fade in split-only mode
+	TIMER_TAP,			// tap tempo entry timeout
+	TIMER_FLASH,		// flash of selected menu item
+	TIMER_SAVE,			// delay before saving settings
+	TIMER_MERGE,		// give up on a stalled message from one input
+	TIMER_RATE,			// traffic rate meter update
+	TIMER_VERSION,		// version display at power up
+	NUM_TIMERS		// no more than 16
+};
+#define TIMER_BIT(t) ((unsigned int)1 << (t))
+#define timerRunning(t) (timerActive & TIMER_BIT(t))
+unsigned int timerCount[NUM_TIMERS];
+unsigned int timerActive = 0;
+unsigned int timerLastTick = 0;	// low bits of systemTicks when last counted down
+
+// Set by the ISR when any button changes state. DEC and INC 
+// are on PORTA so use interrupt-on-change. RUN is on RC3 which
+// has no IOC, so the timer 0 ISR samples it each ms
+volatile byte buttonChange = 1;
+volatile byte lastRunPin = 1;
+
+// define the buffer used to receive MIDI input. The size
+// can be set at build time but must be a power of two so
+// we can wrap the buffer position with a mask. A single
+// array has to fit within an 80 byte RAM bank, so 64 is
+// the largest size that will work
+#ifndef SZ_RXBUFFER
+#define SZ_RXBUFFER 64
+#endif
+#if (SZ_RXBUFFER & (SZ_RXBUFFER - 1)) || (SZ_RXBUFFER > 64)
+#error SZ_RXBUFFER must be a power of two no larger than 64
+#endif
 volatile byte rxBuffer[SZ_RXBUFFER];
 volatile byte rxHead = 0;
 volatile byte rxTail = 0;
 
+// when the rx ISR has to drop a byte it marks the position
+// in the buffer, so that midiThru knows where the input 
+// has a gap in it
+volatile byte rxGap = 0;
+volatile byte rxGapPos = 0;
+
+// second MIDI input. This is a software UART on RA3, which 
+// sees the falling edge of the start bit with interrupt on 
+// change and then samples the middle of each bit from the
+// timer 4 ISR. Its bytes are merged with the main input by
+// midiThru, a whole message at a time
+#define SOFT_UART_BIT_CYCLES	128	// 32us at 4MHz instruction clock
+#define SOFT_UART_START_CYCLES	176	// to the middle of the first data bit, 
+									// less the time taken to start the timer
+#define SZ_RX2BUFFER 32 // must be a power of 2
+volatile byte rx2Buffer[SZ_RX2BUFFER];
+volatile byte rx2Head = 0;
+volatile byte rx2Tail = 0;
+volatile byte rx2Gap = 0;
+volatile byte rx2GapPos = 0;
+volatile byte rx2Shift = 0;		// bits received so far
+volatile byte rx2Bit = 0;		// number of data bits received
+
+// order that bytes arrived at either input, so that the next
+// message can be taken from whichever input got it first
+volatile byte rxArrival = 0;
+volatile byte rxStamp[SZ_RXBUFFER];
+volatile byte rx2Stamp[SZ_RX2BUFFER];
+#define MERGE_TIMEOUT 20	// ms to wait for the rest of a message
+#define MERGE_SYSEX_TIMEOUT 1000	// ..or a sysex, which can pause between packets
+
+// traffic rate meter. The ISRs count bytes in and out and
+// status bytes in, and every 125ms the main loop folds the 
+// counts into a rolling total for the last second or so
+#define RATE_PERIOD		125			// ms between updates
+#define RATE_PEAK_HOLD	16			// updates that the peak is held for
+#define LINK_BYTES_PER_SEC 3125		// 31250 baud, 10 bits per byte
+volatile unsigned int rxByteCount = 0;
+volatile unsigned int txByteCount = 0;
+volatile unsigned int rxMsgCount = 0;
+unsigned int rxByteRate = 0;		// bytes per second in
+unsigned int txByteRate = 0;		// bytes per second out
+unsigned int rxMsgRate = 0;			// messages per second in
+byte ratePeak = 0;					// peak hold level (LEDs)
+byte ratePeakHold = 0;
+
+// thinning of continuous controller data. When the output 
+// queue backs up, a control change, channel pressure or pitch
+// bend message is held back instead of sent, and if the next
+// message is the same one with a new value it replaces it.
+// Only the continuous controllers in THIN_CONTROLLER are 
+// thinned: the 14 bit pairs 0-31 (MSB) and 32-63 (LSB) apart
+// from data entry 6/38. Switches, increments, (N)RPN numbers 
+// and mode messages always go out as they are. An LSB that 
+// follows its MSB is held along with it, so the pair stays
+// together and in order
+#define THIN_HIGH_WATER ((SZ_TXBUFFER * 3) / 4)
+#define THINNABLE(s) (((s) & 0xF0) == 0xB0 || ((s) & 0xF0) == 0xD0 || ((s) & 0xF0) == 0xE0)
+#define THIN_CONTROLLER(c) ((c) < 64 && ((c) & 0x1F) != 6)
+byte thinMsg[3];			// message being collected
+byte thinLen = 0;
+byte heldMsg[5];			// message (or MSB+LSB pair) being held back
+byte heldLen = 0;
+
+// notes that are sounding downstream, one bit for each note 
+// on each channel. The map is split into four arrays of four
+// channels since each has to fit within a RAM bank. A panic 
+// sends a note off for just the notes that are set
+#define SZ_NOTEMAP 64
+byte noteMap0[SZ_NOTEMAP];		// channels 1-4
+byte noteMap1[SZ_NOTEMAP];		// channels 5-8
+byte noteMap2[SZ_NOTEMAP];		// channels 9-12
+byte noteMap3[SZ_NOTEMAP];		// channels 13-16
+byte noteNumber = 0;			// note of the message being parsed
+volatile byte panicPending = 0;	// set to send a panic between messages
+
+// LEDs are animated by thru traffic in split-only mode, unless
+// they are showing the rate meter
+#if FEATURE_ANIMATE
+#define THRU_ANIMATE() (MODE_NOCLOCK == _mode && (_options & OPTION_THRUANIMATE) && !(_options2 & OPTION2_RATEMETER))
+#else
+#define THRU_ANIMATE() 0
+#endif
+
+// define the buffer used to queue MIDI output. This
+// is drained from the TX interrupt so that sending a
+// byte does not stall the main loop
+#define SZ_TXBUFFER 32 // must be a power of 2
+volatile byte txBuffer[SZ_TXBUFFER];
+volatile byte txHead = 0;
+volatile byte txTail = 0;
+byte txRunningStatus = 0;	// last channel status byte queued
+
+// define the buffer used to queue MIDI realtime output 
+// (clock, start, stop etc). This is always drained ahead
+// of the main output buffer, so realtime messages do not
+// wait behind queued channel or sysex data
+#define SZ_RTBUFFER 8 // must be a power of 2
+volatile byte rtBuffer[SZ_RTBUFFER];
+volatile byte rtHead = 0;
+volatile byte rtTail = 0;
+
+// error counters. These stick at 255 rather than 
+// wrapping round and can be viewed from the menu
+volatile byte rxDropCount = 0;		// bytes lost because rxBuffer was full
+volatile byte rxOverrunCount = 0;	// UART hardware overruns (OERR)
+volatile byte txDropCount = 0;		// bytes lost because an output buffer was full
+byte sysexAbortCount = 0;			// sysex messages cut short by lost input
+byte lateTickCount = 0;				// ticks the main loop was too busy to see
+byte thinCount = 0;					// messages replaced by a later value
+#define NUM_STATS 6
 
 // Configuration options
 enum {
@@ -140,200 +485,2092 @@ enum {
 	OPTION_STARTSTOP 		= 0x04,	
 	OPTION_THRUANIMATE 		= 0x08,
 	OPTION_DISCREET 		= 0x10,
+	OPTION_HARDTHRU 		= 0x20,
+	OPTION_RUNSTATUS 		= 0x40,
+	OPTION_FINETEMPO 		= 0x80,
 	OPTIONS_DEFAULT 		= OPTION_PASSOTHERMSG|OPTION_STARTSTOP|OPTION_THRUANIMATE
 };
 byte _options = OPTIONS_DEFAULT;
 
+// More configuration options
+enum {
+	OPTION2_CLOCKSLAVE 		= 0x01,
+	OPTION2_RATEMETER 		= 0x02,
+	OPTIONS2_DEFAULT 		= 0
+};
+#define OPTIONS2_BAR_SHIFT	5	// _barLength - 1 is saved in the top bits
+#define OPTIONS2_BAR_MASK	0xE0
+#define OPTIONS2_OFFSET_SHIFT	2	// and _clockOffset in 3 bits below that
+#define OPTIONS2_OFFSET_MASK	0x1C
+byte _options2 = OPTIONS2_DEFAULT;
+
 // Operating modes
 enum {
 	MODE_STEP,		// BEAT CLOCK ON, INC/DEC SET
 	MODE_TAP,		// BEAT CLOCK ON, TAP SET
 	MODE_NOCLOCK,	// BEAT CLOCK OFF
-	MODE_MENU		// BEAT CLOCK OFF, OPTIONS MENU
+	MODE_MENU,		// BEAT CLOCK OFF, OPTIONS MENU
+	MODE_STATS		// BEAT CLOCK OFF, ERROR COUNTER DISPLAY
 };
 byte _mode = MODE_STEP;
 
+// mode the hub starts in and goes back to from the menu
+#if FEATURE_CLOCK
+#define MODE_HOME MODE_STEP
+#else
+#define MODE_HOME MODE_NOCLOCK
+#endif
+
+// Clock output ratios. The output clock can be multiplied
+// or divided from the 24PPQN tick. Multiplied ticks are timed
+// within each tick by CCP2 so they are evenly spaced, and 
+// divided ticks are counted from the beat
+enum {
+	CLOCK_RATIO_DIV4,
+	CLOCK_RATIO_DIV3,
+	CLOCK_RATIO_DIV2,
+	CLOCK_RATIO_X1,
+	CLOCK_RATIO_X2,
+	CLOCK_RATIO_X4,
+	NUM_CLOCK_RATIOS
+};
+byte _clockRatio = CLOCK_RATIO_X1;
+
+// Swing. Each pair of 16th notes is split unevenly, the first 
+// one getting 50% (no swing) up to 70% of the time. The period
+// of every tick in the beat is worked out by setBPM() so that
+// the ISR just has to look it up
+#define NUM_SWING_LEVELS 6
+#define SWING_PERCENT(s) (50 + 4 * (s))
+#define SZ_GROOVE 24
+byte _swing = 0;
+#if FEATURE_CLOCK
+volatile unsigned int grooveTable[SZ_GROOVE];		// timer counts for each tick
+volatile unsigned int grooveRem = 0;	// remainder of each 8th note, spread like tickPeriodRem
+#endif
+
+// Settings record being written to EEPROM
+enum {
+	SETTINGS_SEQ,			// sequence number
+	SETTINGS_OPTIONS,		// _options
+	SETTINGS_OPTIONS2,		// _options2
+	SETTINGS_CLOCK_RATIO,	// (_swing << 4) | _clockRatio
+	SETTINGS_BPM_LO,		// _bpm
+	SETTINGS_BPM_HI,
+	SETTINGS_MODE,			// (_mode << 4) | run lock | _brightness
+	SETTINGS_CHECK			// cookie XOR sum of the other bytes
+};
+byte settingsRecord[SZ_SETTINGS];
+byte settingsSlot = EEPROM_NUM_SLOTS - 1;	// slot of the last save
+byte settingsWritePos = 0xFF;			// next byte to write (filter then record)
+byte settingsDirty = 0;
+int settingsBPM = 0;			// tempo and mode last seen by
+byte settingsMode = MODE_STEP;	// serviceSettings()
+byte settingsRunLock = 0;
+#define SETTINGS_MODE_RUNLOCK 0x08	// run lock flag in SETTINGS_MODE
+#if FEATURE_CLOCK
+volatile byte clockDivide = 1;		// send every Nth tick
+volatile byte clockMultShift = 0;	// send 2^N ticks per tick
+volatile byte ratioCount = 0;		// ticks since last divided tick
+volatile byte subTicks = 0;			// multiplied ticks still to send
+volatile unsigned int subStep = 0;	// timer counts between them
+volatile byte subDiv = 1;			// multiplied ticks per tick
+volatile byte subRem = 0;			// remainder of the division..
+volatile byte subFrac = 0;			// ..and how much has built up
+volatile unsigned int subTime = 0;	// timer count for next one
+
+// Clock phase for a START or CONTINUE between ticks, so that the
+// next tick is tick t of beat b. The counts are left one tick 
+// before that, the divided ticks are lined up with the beat and
+// multiplied ticks left over from the tick we are in are dropped
+// (the next CCP1 match sets them up again). A macro since the 
+// ISR and the main loop (with interrupts off) both need it
+#define RESET_CLOCK_PHASE(t, b) { \
+	if(t) { tickCount = (t) - 1; barBeat = (b); } \
+	else { tickCount = 23; barBeat = ((b) ? (b) : _barLength) - 1; } \
+	ratioCount = (t) % clockDivide; subTicks = 0; pie2.0 = 0; }
+#endif
+
 // Brightness settings
 #define NUM_BRIGHTNESS_LEVELS 6
 byte brightnessLevels[NUM_BRIGHTNESS_LEVELS];
 byte _brightness = 0;
 
-// LED duty buffer
-byte duty[6];
+// Message filter. One bit for each status byte from 0x80 to 
+// 0xFF, set if messages with that status are passed on. Each
+// pair of bytes is one type of channel message, with a bit per
+// channel. The last pair is F0-FF
+#define SZ_FILTER 16
+byte midiFilter[SZ_FILTER] = {
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF
+};
+rom char *filterBit = {0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80};
+#define FILTER_PASS(q) (midiFilter[((q) >> 3) & 0x0F] & filterBit[(q) & 0x07])
+
+// MIDI input parser state
+byte midiStatus = 0;		// running status, or 0 if there is none
+byte midiNumParams = 0;		// number of data bytes in current message
+byte midiParamIndex = 0;	// number of data bytes received so far
+byte midiInSysex = 0;		// set while passing a sysex message
+byte midiDiscard = 0;		// set to skip data bytes after input was lost
+byte midiBlock = 0;			// set when the filter blocks the current message
+byte midiMsgOpen = 0;		// set while part way through a message
+byte midiInput = 0;			// input being parsed (0 = main, 1 = second)
+byte midiOtherStatus = 0;	// running status of the other input
+byte midiOtherDiscard = 0;	// and whether it is skipping data bytes
+
+// sysex messages addressed to the hub
+#define SZ_HUBSYSEX 8
+byte hubSysex[SZ_HUBSYSEX];	// message bytes after the device ID
+byte hubSysexIndex = 0;		// number of data bytes since F0
+byte hubSysexMatch = 0;		// set while the sysex looks like it is for us
+byte hubSysexReady = 0;		// set when a complete message is in hubSysex
+
+#ifdef INSTRUMENT
+// Instrumentation build. The ISR takes timestamps along the 
+// clock and thru paths and leaves each finished measurement
+// for the main loop, which keeps the statistics. These can 
+// be read out with SYSEX_CMD_INSTR_DUMP
+enum {
+	INSTR_PROBE_IDLE,		// rx ISR can start a new probe
+	INSTR_PROBE_RX,			// probe byte is waiting in rxBuffer
+	INSTR_PROBE_CLAIMED,	// midiThru is working on the probe byte
+	INSTR_PROBE_TX,			// probe byte is waiting in txBuffer
+	INSTR_PROBE_DONE		// measurement ready for the main loop
+};
+volatile byte instrThruState = INSTR_PROBE_IDLE;
+volatile byte instrThruPos = 0;			// probe byte position in rxBuffer/txBuffer
+volatile byte instrThruMs = 0;			// timer 0 timestamp on arrival
+volatile byte instrThruT0 = 0;
+volatile byte instrThruDoneMs = 0;		// timer 0 timestamp when sent
+volatile byte instrThruDoneT0 = 0;
+volatile byte instrTickArmed = 0;		// set while a generated tick is queued
+volatile byte instrTickPos = 0;			// position of the tick in rtBuffer
+volatile byte instrTickReady = 0;		// set when instrTickTime is valid
+volatile unsigned int instrTickTime = 0;// timer 1 count when the tick was sent
+volatile byte instrRx2Late = 0;			// latest soft UART sample in this byte (cycles)
+volatile byte instrRx2Ready = 0;		// set when instrRx2Time is valid
+volatile byte instrRx2Time = 0;
+
+// a timestamp is the low byte of systemTicks plus the timer 0
+// count (4us per count). Allow for timer 0 having rolled over
+// since the ISR serviced it, in which case it is counting from
+// zero rather than the init value (as in getTapTime())
+#define INSTR_STAMP(ms, t0) { (t0) = tmr0; (ms) = (byte)systemTicks; if(intcon.2 && (t0) < 128) { ++(ms); (t0) += TIMER_0_INIT_SCALAR; } }
+
+// statistics for one measurement (all times in us)
+#define INSTR_HIST_BINS 8	// <64us, <128us ... <4096us, >=4096us
+typedef struct {
+	unsigned int count;
+	unsigned int min;
+	unsigned int max;
+	unsigned long total;
+	unsigned int hist[INSTR_HIST_BINS];
+} INSTR_STAT;
+INSTR_STAT instrTickTx;		// tempo tick to clock byte loaded into UART
+INSTR_STAT instrTickMain;	// tempo tick to main loop handling it
+INSTR_STAT instrThru;		// byte received to byte loaded into UART
+INSTR_STAT instrRx2;		// latest soft UART sample in each byte
+#endif
+
+// LED duty buffer. This is scanned by the timer 2 ISR
+volatile byte duty[6];
+volatile byte ledPlane = 1;		// duty bit being displayed by the ISR
+volatile byte ledFlicker = 0;	// set to light LEDs 2 and 3 for one cycle
+byte ledFlickerCycle = 0;
+
+#if FEATURE_CLOCK
+// LED animation frames for the clock, one bit per LED. Each
+// animation has a frame for each tick of the beat
+enum {
+	FRAMES_RUNNING,				// cycling "running" animation
+	FRAMES_PAUSED,				// flashing "paused" indicator (leds 0,1,4,5)
+	FRAMES_DISCREET_RUNNING,	// the same with the discreet option
+	FRAMES_DISCREET_PAUSED
+};
+#define FRAMES_PER_BEAT 24
+rom char *clockFrames = {
+	0x01, 0x01, 0x01, 0x01, 0x02, 0x02, 0x02, 0x02, 0x04, 0x04, 0x04, 0x04,
+	0x08, 0x08, 0x08, 0x08, 0x10, 0x10, 0x10, 0x10, 0x20, 0x20, 0x20, 0x20,
+	
+	0x33, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	
+	0x01, 0x21, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01,
+	0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01,
+	
+	0x20, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00
+};
+#endif
+
+#if FEATURE_TAP
+// LEDs for tap tempo entry by the number of taps so far. LED 0 
+// is always lit, brighter than the others
+rom char *tapFrames = {0x00, 0x00, 0x02, 0x06, 0x0E, 0x1E, 0x3E};
+#endif
 
-// BPM setting
+// BPM setting (tenths of a BPM)
 int _bpm = 0;
 
+#if FEATURE_CLOCK
 ////////////////////////////////////////////////////////////
-// INTERRUPT HANDLER CALLED WHEN CHARACTER RECEIVED AT 
-// SERIAL PORT OR WHEN TIMER 1 OVERLOWS
-void interrupt( void )
+// SHOULD THE THRU OUTPUT BE HELD BACK?
+// Only for use by interrupt(). When START or CONTINUE goes out
+// with the next tick the thru is held for the last part of the
+// tick, long enough for a byte in the shift register and one
+// in TXREG to finish, so that the line is idle for the START.
+// The rest of the tick the thru carries on as normal
+byte isrTxHeld()
 {
-	// timer 0 rollover ISR. Maintains the count of 
-	// "system ticks" that we use for key debounce etc
-	if(intcon.2)
+	if(!txHold)
+		return 0;
+	unsigned int t;
+	READ_TIMER1(t);
+	unsigned int c = ((unsigned int)ccpr1h << 8) | ccpr1l;
+	return (t >= c) || (c - t < TX_HOLD_COUNTS);
+}
+#endif
+
+////////////////////////////////////////////////////////////
+// QUEUE A BYTE TO SEND FROM INSIDE THE ISR
+// Only for use by interrupt(). If the output buffer is
+// full the byte is dropped, since we can't wait here
+void isrSend(byte b)
+{
+	if(!pie1.4 && pir1.4 && !TX_HELD())
 	{
-		tmr0 = TIMER_0_INIT_SCALAR;
-		systemTicks++;
-		intcon.2 = 0;
+		// nothing queued and the transmit register
+		// is empty, so send it immediately
+		txreg = b;
+		++txByteCount;
+	}
+	else
+	{
+		// queue the byte behind whatever is waiting
+		byte nextTxHead = (txHead + 1) & (SZ_TXBUFFER - 1);
+		if(nextTxHead != txTail)
+		{
+			txBuffer[txHead] = b;
+			txHead = nextTxHead;
+			pie1.4 = 1;
+		}
+		else if(txDropCount != 0xFF)
+		{
+			++txDropCount;
+		}
 	}
+}
 
-	// timer 1 rollover ISR. Responsible for timing
-	// the tempo of the MIDI clock
-	if(pir1.0)
+////////////////////////////////////////////////////////////
+// QUEUE A MIDI REALTIME BYTE TO SEND FROM INSIDE THE ISR
+// Only for use by interrupt()
+void isrSendRealtime(byte b)
+{
+	if(!pie1.4 && pir1.4)
 	{
-		tmr1l=(timer_init_scalar & 0xff); 
-		tmr1h=(timer_init_scalar>>8); 
-		tick_flag = 1;
-		pir1.0 = 0;
+		// nothing queued and the transmit register
+		// is empty, so send it immediately
+		txreg = b;
+		++txByteCount;
 	}
-		
-	// serial rx ISR
-	if(pir1.5)
-	{	
-		// get the byte
-		byte b = rcreg;
-		
-		// calculate next buffer head
-		byte nextHead = (rxHead + 1);
-		if(nextHead >= SZ_RXBUFFER) 
+	else
+	{
+		byte nextRtHead = (rtHead + 1) & (SZ_RTBUFFER - 1);
+		if(nextRtHead != rtTail)
 		{
-			nextHead -= SZ_RXBUFFER;
+			rtBuffer[rtHead] = b;
+			rtHead = nextRtHead;
+			pie1.4 = 1;
 		}
-		
-		// if buffer is not full
-		if(nextHead != rxTail)
+		else if(txDropCount != 0xFF)
 		{
-			// store the byte
-			rxBuffer[rxHead] = b;
-			rxHead = nextHead;
-		}		
+			++txDropCount;
+		}
 	}
 }
 
 ////////////////////////////////////////////////////////////
-// SAVE OPTIONS TO EEPROM
-void saveOptions()
+// HANDLE A BYTE FROM THE SECOND MIDI INPUT
+// Only for use by interrupt(). Realtime bytes go straight out
+// like the ones from the main input, the rest are buffered 
+// for midiThru to merge in. That can't be done in hardware
+// thru mode, so there only realtime bytes are passed on
+void isrRx2Byte(byte b)
 {
-	eeprom_write(EEPROM_ADDR_OPTIONS, _options);
-	eeprom_write(EEPROM_ADDR_MAGIC_COOKIE, EEPROM_MAGIC_COOKIE);
+	++rxByteCount;
+	if(b & 0x80)
+		++rxMsgCount;
+	if((b & 0xF8) == 0xF8)
+	{
+		if((_options & OPTION_PASSREALTIMEMSG) && FILTER_PASS(b))
+			isrSendRealtime(b);
+		return;
+	}
+	if(_options & OPTION_HARDTHRU)
+		return;
+	byte nextHead = (rx2Head + 1) & (SZ_RX2BUFFER - 1);
+	if(nextHead != rx2Tail)
+	{
+		rx2Buffer[rx2Head] = b;
+		rx2Stamp[rx2Head] = rxArrival++;
+		rx2Head = nextHead;
+	}
+	else
+	{
+		if(!rx2Gap)
+		{
+			rx2GapPos = rx2Head;
+			rx2Gap = 1;
+		}
+		if(rxDropCount != 0xFF)
+			++rxDropCount;
+	}
 }
 
 ////////////////////////////////////////////////////////////
-// LOAD OPTIONS FROM EEPROM
-void loadOptions()
+// SAMPLE THE SECOND MIDI INPUT
+// Only for use by interrupt(). This is a software UART, so 
+// each bit has to be sampled within about 20us of the middle
+// of the bit. The ISR can't be interrupted, so as well as at
+// the start of interrupt() this is called between each of the
+// longer pieces of work it does. A sample is then late by no 
+// more than the longest of those pieces (the INSTRUMENT build
+// measures this). The falling edge of the start bit starts 
+// timer 4, timed to the middle of the first data bit, and 
+// edges are ignored until the stop bit
+void isrSoftUart()
 {
-	// "magic cookie" is a known value written to the EEPROM
-	// with each valid save. Makes sure we can avoid reading
-	// garbage from EEPROM when there is no previous save
-	_options = eeprom_read(EEPROM_ADDR_OPTIONS);
-	if(eeprom_read(EEPROM_ADDR_MAGIC_COOKIE) != EEPROM_MAGIC_COOKIE)
-		_options = OPTIONS_DEFAULT; 
+	if(iocaf.3)
+	{
+		iocan.3 = 0;
+		iocaf &= ~0x08; // IOCAF3, without touching the other flags
+		tmr4 = 0;
+		pr4 = SOFT_UART_START_CYCLES - 1;
+		rx2Bit = 0;
+		pir3.1 = 0;
+		t4con.2 = 1; // timer 4 on
+	}
+	if(pir3.1)
+	{
+#ifdef INSTRUMENT
+		// timer 4 counts instruction cycles since the sample
+		// was due
+		byte late = tmr4;
+		if(late > instrRx2Late)
+			instrRx2Late = late;
+#endif
+		pr4 = SOFT_UART_BIT_CYCLES - 1;
+		if(rx2Bit < 8)
+		{
+			// data bits come LSB first
+			rx2Shift >>= 1;
+			if(P_MIDI2)
+				rx2Shift |= 0x80;
+			++rx2Bit;
+		}
+		else
+		{
+			// the stop bit should be high, if not it is a 
+			// framing error and the byte is dropped
+			t4con.2 = 0;
+			if(P_MIDI2)
+				isrRx2Byte(rx2Shift);
+			iocaf &= ~0x08; // IOCAF3
+			iocan.3 = 1;
+#ifdef INSTRUMENT
+			if(!instrRx2Ready)
+			{
+				instrRx2Time = instrRx2Late;
+				instrRx2Ready = 1;
+			}
+			instrRx2Late = 0;
+#endif
+		}
+		pir3.1 = 0;
+	}
 }
 
-
+#if FEATURE_CLOCK
 ////////////////////////////////////////////////////////////
-// INITIALISE SERIAL PORT FOR MIDI
-void initUSART()
+// HANDLE A TICK OF THE MIDI CLOCK
+// Only for use by interrupt(). The clock is sent from here so
+// that it goes out at the tick and not when the main loop 
+// notices
+void isrClockTick()
 {
-	pir1.1 = 1;		//TXIF 		
-	pir1.5 = 0;		//RCIF
-	
-	pie1.1 = 0;		//TXIE 		no interrupts
-	pie1.5 = 1;		//RCIE 		enable
-	
-	baudcon.4 = 0;	// SCKP		synchronous bit polarity 
-	baudcon.3 = 1;	// BRG16	enable 16 bit brg
-	baudcon.1 = 0;	// WUE		wake up enable off
-	baudcon.0 = 0;	// ABDEN	auto baud detect
+	if(MODE_STEP == _mode || MODE_TAP == _mode)
+	{
+		if(++tickCount > 23)
+		{
+			tickCount = 0;
+			
+			// keep divided ticks in line with the beat
+			ratioCount = 0;
+			
+			if(++barBeat >= _barLength)
+				barBeat = 0;
+		}
 		
-	txsta.6 = 0;	// TX9		8 bit transmission
-	txsta.5 = 1;	// TXEN		transmit enable
-	txsta.4 = 0;	// SYNC		async mode
-	txsta.3 = 0;	// SEDNB	break character
-	txsta.2 = 0;	// BRGH		high baudrate 
-	txsta.0 = 0;	// TX9D		bit 9
-
-	rcsta.7 = 1;	// SPEN 	serial port enable
-	rcsta.6 = 0;	// RX9 		8 bit operation
-	rcsta.5 = 1;	// SREN 	enable receiver
-	rcsta.4 = 1;	// CREN 	continuous receive enable
+		// start and stop requests wait for the start of a bar,
+		// unless the bar is only one beat long. A restart always
+		// waits for the start of the bar
+		byte barStart = !tickCount && !barBeat;
+		if(runRequest && (barStart || 1 == _barLength))
+		{
+			if(RUN_REQUEST_STOP == runRequest)
+			{
+				running = 0;
+				if(_options & OPTION_STARTSTOP)
+					isrSendRealtime(MIDI_SYNCH_STOP);
+				panicPending = 1;
+				resumeTick = 0;
+				resumeBeat = 0;
+				runRequest = RUN_REQUEST_NONE;
+			}
+			else if(!sppPending && !sppWait)
+			{
+				// if a song position has been set we carry 
+				// on from there, once the pointer has gone
+				if(_options & OPTION_STARTSTOP)
+					isrSendRealtime(songPosition ? MIDI_SYNCH_CONTINUE : MIDI_SYNCH_START);
+				tickCount = resumeTick;
+				barBeat = resumeBeat;
+				
+				// this tick is the first one, so line the divided
+				// ticks up with the beat. (The multiplied ticks CCP1
+				// has just set up are for this tick and are kept)
+				ratioCount = resumeTick % clockDivide;
+				positionTicks = 0;
+				running = 1;
+				runRequest = RUN_REQUEST_NONE;
+			}
+		}
+		else if(midiRestart && barStart)
+		{
+			isrSendRealtime(MIDI_SYNCH_START);
+			songPosition = 0;
+			positionTicks = 0;
+			midiRestart = 0;
+		}
 		
-	spbrgh = 0;		// brg high byte
-	spbrg = 31;		// brg low byte (31250)	
-	
+		byte sendTick = !ratioCount;
+		if(++ratioCount >= clockDivide)
+			ratioCount = 0;
+		if(running && sendTick)
+		{
+#ifdef INSTRUMENT
+			// take note of where the tick goes in the
+			// realtime queue. If it doesn't go in the queue
+			// it was sent straight away
+			instrTickPos = rtHead;
+			instrTickArmed = 1;
+			isrSendRealtime(MIDI_SYNCH_TICK);
+			if(instrTickPos == rtHead)
+			{
+				if(!instrTickReady)
+				{
+					READ_TIMER1(instrTickTime);
+					instrTickReady = 1;
+				}
+				instrTickArmed = 0;
+			}
+#else
+			isrSendRealtime(MIDI_SYNCH_TICK);
+#endif
+		}
+		if(running && ++positionTicks >= 6)
+		{
+			positionTicks = 0;
+			++songPosition;
+		}
+		
+		// when START or CONTINUE goes out with the next tick, the
+		// thru output is held back at the end of this tick (see
+		// isrTxHeld()) so that it goes out on an idle line just
+		// ahead of the tick
+		txHold = (23 == tickCount) && (barBeat == _barLength - 1) && !sppPending && !sppWait &&
+			(midiRestart || (RUN_REQUEST_START == runRequest && (_options & OPTION_STARTSTOP)));
+		if(!txHold && txHead != txTail)
+			pie1.4 = 1;
+		
+		// let the main loop know, for the display
+		if(ticksPending != 0xFF)
+			++ticksPending;
+	}
+	else
+	{
+		// no clock in this mode, so drop any start or stop
+		// that was waiting and let the thru output go
+		runRequest = RUN_REQUEST_NONE;
+		if(txHold)
+		{
+			txHold = 0;
+			if(txHead != txTail)
+				pie1.4 = 1;
+		}
+	}
 }
 
 ////////////////////////////////////////////////////////////
-// SEND A BYTE ON SERIAL PORT
-void send(byte c)
+// HANDLE AN INCOMING TICK OF AN EXTERNAL CLOCK
+// Only for use by interrupt(). 
+void isrSlaveTick()
 {
-	txreg = c;
-	while(!txsta.1);
+	unsigned int ph;
+	slaveTimeout = SLAVE_TIMEOUT;
+	if(SLAVE_LOCKED != slaveState)
+	{
+		// While acquiring the tempo, timer 1 is restarted on 
+		// each incoming tick so we can measure the interval. 
+		// The CCP is parked at the top of the timer range, with 
+		// its interrupt off so that a slow clock reaching the top
+		// can't keep interrupting, and the incoming ticks are 
+		// passed straight through
+		t1con.0 = 0;
+		ph = ((unsigned int)tmr1h << 8) | tmr1l;
+		tmr1h = 0;
+		tmr1l = 0;
+		t1con.0 = 1;
+		if(SLAVE_IDLE == slaveState)
+		{
+			// (no multiplied ticks until we are locked)
+			pie2.0 = 0;
+			pie1.2 = 0;
+			ccpr1l = 0xFF;
+			ccpr1h = 0xFF;
+			slavePeriod = 0;
+			slaveCount = 0;
+			slaveState = SLAVE_ACQUIRE;
+		}		
+		else
+		{
+			slavePeriod += ph;
+			if(++slaveCount >= SLAVE_ACQUIRE_TICKS)
+			{
+				// we have the average period now, in 1/256ths
+				// of a timer count, and timer 1 has just been
+				// restarted in line with the incoming tick
+				slavePeriod <<= (8 - SLAVE_ACQUIRE_SHIFT);
+				tickPeriod = (slavePeriod >> 8);
+				tickPeriodRem = (slavePeriod & 0xFF);
+				tickPeriodDiv = 256;
+				tickPhase = 0;
+				ph = tickPeriod - 1;
+				ccpr1l = (ph & 0xff);
+				ccpr1h = (ph >> 8);
+				pir1.2 = 0;
+				pie1.2 = 1;
+				slavePeriodNew = 1;
+				slaveTickDiff = 0;
+				slaveCount = 0;
+				slaveState = SLAVE_LOCKED;
+			}
+		}
+		isrClockTick();
+		return;
+	}
+	
+	// Locked to the external clock. Work out how far our own
+	// ticks are ahead (+) or behind (-) the incoming one, less
+	// the clock offset we want to have. We keep a count of ticks
+	// in each direction so that large jitter can't make us slip
+	// a whole tick.
+	READ_TIMER1(ph); // time since our last tick
+	--slaveTickDiff;
+	long err = ph;
+	err -= slaveOffset;
+	if(slaveTickDiff > 0)
+	{
+		err += tickPeriod;
+		if(slaveTickDiff > 1)
+			err += tickPeriod;
+	}
+	else if(slaveTickDiff < 0)
+	{
+		err -= tickPeriod;
+		if(slaveTickDiff < -1)
+			err -= tickPeriod;
+	}
+	if(slaveTickDiff > 2 || slaveTickDiff < -2)
+	{
+		// we've lost track, so start again
+		slaveState = SLAVE_IDLE;
+		return;
+	}
+	isrSoftUart();
+	
+	// Second order loop filter. The error feeds the period 
+	// (integral term) and also makes a one-off adjustment to
+	// the next period (proportional term). For the first few
+	// beats we use higher gains so that we pull in quickly, 
+	// then lower ones to filter out the jitter
+	if(slaveCount < SLAVE_FAST_TICKS)
+	{
+		++slaveCount;
+		slavePeriod += (err << 2);	// 1/64
+		slaveAdjust = (err >> 2);	// 1/4
+	}
+	else
+	{
+		slavePeriod += (err >> 1);	// 1/512
+		slaveAdjust = (err >> 4);	// 1/16
+	}
+	if(slavePeriod < ((unsigned long)SLAVE_MIN_PERIOD << 8))
+	{
+		// too fast to follow
+		slaveState = SLAVE_IDLE;
+		return;
+	}
+	tickPeriod = (slavePeriod >> 8);
+	tickPeriodRem = (slavePeriod & 0xFF);
+	slavePeriodNew = 1;
 }
+#endif
 
 ////////////////////////////////////////////////////////////
-// RUN MIDI THRU
-void midiThru()
+// INTERRUPT HANDLER CALLED WHEN CHARACTER RECEIVED AT 
+// SERIAL PORT, WHEN SERIAL PORT IS READY TO SEND, ON 
+// TEMPO TIMER COMPARE MATCH OR WHEN TIMER 0 OR 2 ROLL OVER
+void interrupt( void )
 {
-	// loop until there is no more data or
-	// we receive a full message
-	for(;;)
+	// software UART for the second MIDI input. This comes 
+	// first so that the bits are sampled as close to the 
+	// middle as we can manage
+	isrSoftUart();
+	
+#if FEATURE_LEDS
+	// timer 2 ISR. Refreshes the LEDs from the duty buffer
+	// using binary code modulation: each bit of the duty
+	// values is shown for a time in proportion to its 
+	// weight, so we need just 6 interrupts per cycle. This
+	// is handled early since the new period must be set 
+	// before timer 2 counts past it
+	if(pir1.1)
 	{
-		// buffer overrun error?
-		if(rcsta.1)
+		byte mask = ledPlane;
+		pr2 = (mask << LED_PLANE_SHIFT) - 1;
+		if(mask == 1)
 		{
-			rcsta.4 = 0;
-			rcsta.4 = 1;
+			// start of a new cycle
+			ledFlickerCycle = ledFlicker;
+			ledFlicker = 0;
 		}
-		// any data in the buffer?
-		if(rxHead == rxTail)
+		P_LED0 = !!(duty[0] & mask);
+		P_LED1 = !!(duty[1] & mask);
+		P_LED2 = !!(duty[2] & mask);
+		P_LED3 = !!(duty[3] & mask);
+		P_LED4 = !!(duty[4] & mask);
+		P_LED5 = !!(duty[5] & mask);
+		if(ledFlickerCycle)
 		{
-			// no data ready
-			return;
+			P_LED2 = 1;
+			P_LED3 = 1;
 		}
+		if(mask == (PWM_MAX + 1)/2)
+			ledPlane = 1;
+		else
+			ledPlane = mask << 1;
+		pir1.1 = 0;
+	}
+#endif
+
+	// timer 0 rollover ISR. Maintains the count of 
+	// "system ticks" that we use for key debounce etc
+	if(intcon.2)
+	{
+		// add rather than load, so that the counts since the 
+		// rollover aren't lost and the tick doesn't run slow.
+		// (The write still clears the prescaler, which costs 
+		// a few cycles each ms)
+		tmr0 += TIMER_0_INIT_SCALAR;
+		systemTicks++;
 		
-		// read the character out of buffer
-		byte q = rxBuffer[rxTail];
-		if(++rxTail >= SZ_RXBUFFER) 
-			rxTail -= SZ_RXBUFFER;
+		// RUN button has no interrupt on change
+		if(P_RUN != lastRunPin)
+		{
+			lastRunPin = P_RUN;
+			buttonChange = 1;
+		}
+		
+#if FEATURE_CLOCK
+		// stop following an external clock that has gone away
+		if(slaveTimeout && !--slaveTimeout)
+		{
+			if(SLAVE_ACQUIRE == slaveState)
+			{
+				// unpark the CCP so our own clock starts again
+				ccpr1l = (tickPeriod - 1) & 0xff;
+				ccpr1h = (tickPeriod - 1) >> 8;
+				t1con.0 = 0;
+				tmr1h = 0;
+				tmr1l = 0;
+				t1con.0 = 1;
+				pir1.2 = 0;
+				pie1.2 = 1;
+			}
+			slaveState = SLAVE_IDLE;
+		}
+#endif
+		intcon.2 = 0;
+	}
 
-		// Check for MIDI realtime message (e.g. clock)
-		if((q & 0xF8) == 0xF8)
+	// interrupt on change ISR for the DEC and INC buttons.
+	// We just note that something changed, the main loop 
+	// reads the buttons after any debounce period
+	if(iocaf.4 || iocaf.5)
+	{
+#if FEATURE_TAP
+		// first falling edge of a DEC press is the tap time.
+		// Timer 0 is dealt with above, so if it has rolled over
+		// since then it is counting from zero
+		if(iocaf.4 && !P_DEC && TAP_STAMP_ARMED == tapStampState)
 		{
-			// if we are not passing realtime messages then skip it
-			if(!(_options & OPTION_PASSREALTIMEMSG))
-				continue;
+			tapStampT0 = tmr0;
+			tapStampTicks = systemTicks;
+			if(intcon.2 && tapStampT0 < 128)
+			{
+				++tapStampTicks;
+				tapStampT0 += TIMER_0_INIT_SCALAR;
+			}
+			tapStampState = TAP_STAMP_LATCHED;
+		}
+#endif
+		iocaf &= ~0x30; // IOCAF4, IOCAF5, leaving IOCAF3 for the soft UART
+		buttonChange = 1;
+	}
+	isrSoftUart();
+
+#if FEATURE_CLOCK
+	// CCP1 compare ISR. Responsible for timing the tempo
+	// of the MIDI clock. The CCP special event trigger has
+	// already reset timer 1 in hardware, so the tick period
+	// does not depend on how long we took to get here. We 
+	// just need to load the period of the following tick
+	if(pir1.2 && (SLAVE_ACQUIRE != slaveState))
+	{
+		unsigned int period;
+		if(_swing && (SLAVE_IDLE == slaveState))
+		{
+			// swing, so the period is from the groove table
+			// for the tick that is starting now
+			byte i = tickCount + 1;
+			if(i >= SZ_GROOVE)
+				i = 0;
+			period = grooveTable[i];
+			
+			// the table leaves out the fraction of a count in
+			// each 8th note, so that is carried over and 
+			// added to the last tick of the 8th when due
+			if(11 == i || 23 == i)
+			{
+				tickPhase += grooveRem;
+				if(tickPhase >= tickPeriodDiv)
+				{
+					tickPhase -= tickPeriodDiv;
+					++period;
+				}
+			}
 		}
 		else
 		{
-			// if we are not passing non-realtime messages then skip it
-			if(!(_options & OPTION_PASSOTHERMSG))
-				continue;
+			period = tickPeriod;
+			tickPhase += tickPeriodRem;
+			if(tickPhase >= tickPeriodDiv)
+			{
+				tickPhase -= tickPeriodDiv;
+				++period;
+			}
 		}
 		
-		// should we animate the LEDs based on thru traffic?
-		if(MODE_NOCLOCK == _mode && (_options & OPTION_THRUANIMATE))
+		// when following an external clock the PLL can ask 
+		// for a one-off change to the period to pull the phase
+		// back into line
+		if(slaveAdjust)
 		{
-			// animate and send
-			duty[q%6] = q%INITIAL_DUTY;
-			send(q);
+			period += slaveAdjust;
+			if(period < SLAVE_MIN_PERIOD)
+				period = SLAVE_MIN_PERIOD;
+			slaveAdjust = 0;
 		}
-		// should we indicate thru traffic with flickering LEDs?
-		else 
-		{					
+		// set up CCP2 to time the multiplied ticks in this 
+		// tick. Each one is tick period / 2^N counts after the
+		// last, with the remainder spread over them
+		if(clockMultShift)
+		{
+			subDiv = 1 << clockMultShift;
+			subTicks = subDiv - 1;
+			subStep = period >> clockMultShift;
+			subRem = period & subTicks;
+			subFrac = subRem;
+			subTime = subStep;
+			ccpr2l = (subTime & 0xff);
+			ccpr2h = (subTime >> 8);
+			pir2.0 = 0;
+			pie2.0 = 1; // CCP2 interrupt enable
+		}
+		
+		--period; // timer resets on the count after the match
+		ccpr1l=(period & 0xff); 
+		ccpr1h=(period>>8); 
+		
+		// one less tick owed to an external master clock
+		if(SLAVE_LOCKED == slaveState)
+			++slaveTickDiff;
+			
+		isrSoftUart();
+		isrClockTick();
+		pir1.2 = 0;
+		isrSoftUart();
+	}
+	
+	// CCP2 compare ISR. Sends the extra ticks when the clock
+	// is multiplied
+	if(pie2.0 && pir2.0)
+	{
+		pir2.0 = 0;
+		if((MODE_STEP == _mode || MODE_TAP == _mode) && running)
+			isrSendRealtime(MIDI_SYNCH_TICK);
+		if(--subTicks)
+		{
+			subTime += subStep;
+			subFrac += subRem;
+			if(subFrac >= subDiv)
+			{
+				subFrac -= subDiv;
+				++subTime;
+			}
+			ccpr2l = (subTime & 0xff);
+			ccpr2h = (subTime >> 8);
+		}
+		else
+		{
+			pie2.0 = 0;
+		}
+	}
+#endif
+		
+	// serial rx ISR
+	if(pir1.5)
+	{	
+		// get the byte
+		byte b = rcreg;
+		++rxByteCount;
+		if(b & 0x80)
+			++rxMsgCount;
+		
+		// MIDI realtime message (e.g. clock)? These are 
+		// passed straight to the realtime output queue from
+		// here so they can't get stuck behind buffered data
+		if((b & 0xF8) == 0xF8)
+		{
+			// when slaved to an external clock the incoming ticks
+			// steer our own clock and are not passed on, but we
+			// always pass on and follow START/STOP/CONTINUE
+#if FEATURE_CLOCK
+			if((_options2 & OPTION2_CLOCKSLAVE) && (MODE_STEP == _mode))
+			{
+				switch(b)
+				{
+					case MIDI_SYNCH_TICK:
+						isrSlaveTick();
+						isrSoftUart();
+						break;
+					case MIDI_SYNCH_START:
+						isrSendRealtime(b);
+						RESET_CLOCK_PHASE(0, 0);
+						songPosition = 0;
+						positionTicks = 0;
+						running = 1;
+						break;
+					case MIDI_SYNCH_CONTINUE:
+						isrSendRealtime(b);
+						RESET_CLOCK_PHASE(resumeTick, resumeBeat);
+						positionTicks = 0;
+						running = 1;
+						break;
+					case MIDI_SYNCH_STOP:
+						// a CONTINUE carries on from the tick after
+						// the last one we sent
+						running = 0;
+						resumeTick = tickCount + 1;
+						resumeBeat = barBeat;
+						if(resumeTick > 23)
+						{
+							resumeTick = 0;
+							if(++resumeBeat >= _barLength)
+								resumeBeat = 0;
+						}
+						isrSendRealtime(b);
+						panicPending = 1;
+						break;
+					default:
+						if((_options & OPTION_PASSREALTIMEMSG) && FILTER_PASS(b))
+							isrSendRealtime(b);
+						break;
+				}
+			}
+			else 
+#endif
+			if((_options & OPTION_PASSREALTIMEMSG) && FILTER_PASS(b))
+			{
+				isrSendRealtime(b);
+			}
+		}
+		else
+		{
+			// in hardware thru mode the byte is forwarded straight
+			// from here, giving a fixed latency whatever the main 
+			// loop is busy with. It still goes into the receive 
+			// buffer so that the main loop can animate the LEDs
+			if((_options & OPTION_HARDTHRU) && (_options & OPTION_PASSOTHERMSG))
+				isrSend(b);
+			
+			// calculate next buffer head
+			byte nextHead = (rxHead + 1) & (SZ_RXBUFFER - 1);
+			
+			// if buffer is not full
+			if(nextHead != rxTail)
+			{
+#ifdef INSTRUMENT
+				// start timing this byte if we are not
+				// already timing one
+				if(INSTR_PROBE_IDLE == instrThruState)
+				{
+					INSTR_STAMP(instrThruMs, instrThruT0);
+					instrThruPos = rxHead;
+					instrThruState = INSTR_PROBE_RX;
+				}
+#endif
+				// store the byte
+				rxBuffer[rxHead] = b;
+				rxStamp[rxHead] = rxArrival++;
+				rxHead = nextHead;
+			}		
+			else 
+			{
+				// mark the gap in the input
+				if(!rxGap)
+				{
+					rxGapPos = rxHead;
+					rxGap = 1;
+				}
+				if(rxDropCount != 0xFF)
+					++rxDropCount;
+			}
+		}
+		
+		// buffer overrun error? the UART stops receiving
+		// until we clear it by resetting CREN
+		if(rcsta.1)
+		{
+			rcsta.4 = 0;
+			rcsta.4 = 1;
+			if(rxOverrunCount != 0xFF)
+				++rxOverrunCount;
+		}
+	}
+	
+	// serial tx ISR. TXIF stays set while the transmit 
+	// register is empty, so we only act on it when TXIE
+	// has been enabled to say there is data queued
+	if(pie1.4 && pir1.4)
+	{
+		// load the next byte, taking realtime 
+		// messages ahead of everything else
+		byte held = TX_HELD();
+		if(rtHead != rtTail)
+		{
+#ifdef INSTRUMENT
+			if(instrTickArmed && (rtTail == instrTickPos))
+			{
+				if(!instrTickReady)
+				{
+					READ_TIMER1(instrTickTime);
+					instrTickReady = 1;
+				}
+				instrTickArmed = 0;
+			}
+#endif
+			txreg = rtBuffer[rtTail];
+			rtTail = (rtTail + 1) & (SZ_RTBUFFER - 1);
+			++txByteCount;
+		}
+		else if(txHead != txTail && !held)
+		{
+#ifdef INSTRUMENT
+			if((INSTR_PROBE_TX == instrThruState) && (txTail == instrThruPos))
+			{
+				INSTR_STAMP(instrThruDoneMs, instrThruDoneT0);
+				instrThruState = INSTR_PROBE_DONE;
+			}
+#endif
+			txreg = txBuffer[txTail];
+			txTail = (txTail + 1) & (SZ_TXBUFFER - 1);
+			++txByteCount;
+#if FEATURE_CLOCK
+			if(sppWait && txTail == sppTxEnd)
+				sppWait = 0;
+#endif
+		}
+		
+		// nothing more to send (or the rest is held back)? 
+		// then stop interrupts until something else gets queued
+		if(rtHead == rtTail && (txHead == txTail || held))
+		{
+			pie1.4 = 0;
+		}
+	}
+}
+
+////////////////////////////////////////////////////////////
+// START ONE OF THE SOFTWARE TIMERS
+// Not for use by the ISR
+void startTimer(byte t, unsigned int ms)
+{
+	timerCount[t] = ms;
+	timerActive |= TIMER_BIT(t);
+}
+
+////////////////////////////////////////////////////////////
+// COUNT DOWN THE SOFTWARE TIMERS
+// Called from the main loop. A pass can take more than 1ms,
+// so the timers are counted down by the time since last time
+void serviceTimers()
+{
+	intcon.7 = 0;
+	unsigned int now = systemTicks;
+	intcon.7 = 1;
+	unsigned int elapsed = now - timerLastTick;
+	if(!elapsed)
+		return;
+	timerLastTick = now;
+	unsigned int mask = 1;
+	for(byte i=0; i<NUM_TIMERS; ++i)
+	{
+		if(timerActive & mask)
+		{
+			if(timerCount[i] > elapsed)
+				timerCount[i] -= elapsed;
+			else
+				timerActive &= ~mask;
+		}
+		mask <<= 1;
+	}
+}
+
+////////////////////////////////////////////////////////////
+// SAVE OPTIONS TO EEPROM
+// The save happens later from serviceSettings(), once there
+// have been no changes for a while
+void saveOptions()
+{
+	settingsDirty = 1;
+	startTimer(TIMER_SAVE, SAVE_DELAY);
+}
+
+////////////////////////////////////////////////////////////
+// SET THE RATIO OF THE OUTPUT CLOCK TO THE 24PPQN TICK
+void setClockRatio(byte r)
+{
+#if FEATURE_CLOCK
+	byte d = 1;
+	byte m = 0;
+	switch(r)
+	{
+		case CLOCK_RATIO_DIV4: d = 4; break;
+		case CLOCK_RATIO_DIV3: d = 3; break;
+		case CLOCK_RATIO_DIV2: d = 2; break;
+		case CLOCK_RATIO_X2: m = 1; break;
+		case CLOCK_RATIO_X4: m = 2; break;
+		default: r = CLOCK_RATIO_X1; break;
+	}
+	_clockRatio = r;
+	
+	// the ISR picks up the new ratio at the next tick. This
+	// is called from loadOptions() before interrupts are first
+	// enabled, so leave GIE the way it was
+	byte gie = intcon.7;
+	intcon.7 = 0;
+	clockDivide = d;
+	clockMultShift = m;
+	ratioCount = 0;
+	if(gie)
+		intcon.7 = 1;
+#else
+	// just kept so that it is saved with the settings
+	if(r >= NUM_CLOCK_RATIOS)
+		r = CLOCK_RATIO_X1;
+	_clockRatio = r;
+#endif
+}
+
+////////////////////////////////////////////////////////////
+// SET THE OFFSET OF OUR CLOCK FROM AN EXTERNAL CLOCK
+void setClockOffset(signed char o)
+{
+	if(o < CLOCK_OFFSET_MIN || o > CLOCK_OFFSET_MAX)
+		o = 0;
+	_clockOffset = o;
+	
+#if FEATURE_CLOCK
+	// the PLL pulls our ticks round to the new offset
+	// (GIE left as it was, as in setClockRatio())
+	int counts = (int)o * CLOCK_OFFSET_STEP;
+	byte gie = intcon.7;
+	intcon.7 = 0;
+	slaveOffset = counts;
+	if(gie)
+		intcon.7 = 1;
+#endif
+}
+
+////////////////////////////////////////////////////////////
+// INITIALISE SERIAL PORT FOR MIDI
+void initUSART()
+{
+	pir1.4 = 1;		//TXIF 		
+	pir1.5 = 0;		//RCIF
+	
+	pie1.4 = 0;		//TXIE 		enabled when data is queued
+	pie1.5 = 1;		//RCIE 		enable
+	
+	baudcon.4 = 0;	// SCKP		synchronous bit polarity 
+	baudcon.3 = 1;	// BRG16	enable 16 bit brg
+	baudcon.1 = 0;	// WUE		wake up enable off
+	baudcon.0 = 0;	// ABDEN	auto baud detect
+		
+	txsta.6 = 0;	// TX9		8 bit transmission
+	txsta.5 = 1;	// TXEN		transmit enable
+	txsta.4 = 0;	// SYNC		async mode
+	txsta.3 = 0;	// SEDNB	break character
+	txsta.2 = 0;	// BRGH		high baudrate 
+	txsta.0 = 0;	// TX9D		bit 9
+
+	rcsta.7 = 1;	// SPEN 	serial port enable
+	rcsta.6 = 0;	// RX9 		8 bit operation
+	rcsta.5 = 1;	// SREN 	enable receiver
+	rcsta.4 = 1;	// CREN 	continuous receive enable
+		
+	spbrgh = 0;		// brg high byte
+	spbrg = 31;		// brg low byte (31250)	
+	
+}
+
+////////////////////////////////////////////////////////////
+// QUEUE A BYTE TO SEND ON SERIAL PORT
+void send(byte c)
+{
+	byte nextHead;
+	
+	// the serial rx ISR can also queue bytes (in hardware
+	// thru mode) so interrupts are held off while we are
+	// working on the buffer. If the buffer is full we have 
+	// to wait for the TX interrupt to make some room
+	for(;;)
+	{
+		intcon.7 = 0;
+		
+		// calculate next buffer head
+		nextHead = (txHead + 1) & (SZ_TXBUFFER - 1);
+		if(nextHead != txTail)
+			break;
+		intcon.7 = 1;
+	}
+	
+	// store the byte and make sure the TX 
+	// interrupt is enabled to send it
+	txBuffer[txHead] = c;
+	txHead = nextHead;
+	pie1.4 = 1;
+	intcon.7 = 1;
+	
+	// keep track of running status on the output. Sysex
+	// and system common messages cancel it
+	if(c & 0x80)
+		txRunningStatus = (c < 0xF0) ? c : 0;
+}
+
+////////////////////////////////////////////////////////////
+// QUEUE A MIDI REALTIME BYTE TO SEND ON SERIAL PORT
+// This goes out at the next byte boundary, ahead of 
+// anything that was queued with send()
+void sendRealtime(byte c)
+{
+	byte nextHead;
+	
+	// the serial rx ISR also queues realtime bytes, so hold
+	// off interrupts while working on the buffer. If it is
+	// full then wait for the TX interrupt to make room
+	for(;;)
+	{
+		intcon.7 = 0;
+		nextHead = (rtHead + 1) & (SZ_RTBUFFER - 1);
+		if(nextHead != rtTail)
+			break;
+		intcon.7 = 1;
+	}
+	rtBuffer[rtHead] = c;
+	rtHead = nextHead;
+	pie1.4 = 1;
+	intcon.7 = 1;
+}
+
+////////////////////////////////////////////////////////////
+// SEND A 16 BIT VALUE IN A SYSEX MESSAGE AS THREE 7 BIT BYTES
+void sendSysexWord(unsigned int v)
+{
+	send((v >> 14) & 0x03);
+	send((v >> 7) & 0x7F);
+	send(v & 0x7F);
+}
+
+#ifdef INSTRUMENT
+////////////////////////////////////////////////////////////
+// ADD A MEASUREMENT (IN US) TO A SET OF STATISTICS
+void instrRecord(INSTR_STAT *stat, unsigned int us)
+{
+	if(!stat->count || us < stat->min)
+		stat->min = us;
+	if(!stat->count || us > stat->max)
+		stat->max = us;
+	if(stat->count != 0xFFFF)
+	{
+		++stat->count;
+		stat->total += us;
+	}
+	
+	// histogram bins double in width from 64us
+	byte bin = 0;
+	us >>= 6;
+	while(us && bin < INSTR_HIST_BINS - 1)
+	{
+		++bin;
+		us >>= 1;
+	}
+	if(stat->hist[bin] != 0xFFFF)
+		++stat->hist[bin];
+}
+
+////////////////////////////////////////////////////////////
+// CLEAR A SET OF STATISTICS
+void instrClear(INSTR_STAT *stat)
+{
+	stat->count = 0;
+	stat->min = 0;
+	stat->max = 0;
+	stat->total = 0;
+	for(byte i=0; i<INSTR_HIST_BINS; ++i)
+		stat->hist[i] = 0;
+}
+
+////////////////////////////////////////////////////////////
+// COLLECT MEASUREMENTS TAKEN BY THE ISR
+void instrUpdate()
+{
+	if(instrTickReady)
+	{
+		instrRecord(&instrTickTx, instrTickTime << 1);
+		instrTickReady = 0;
+	}
+	if(INSTR_PROBE_DONE == instrThruState)
+	{
+		byte ms = instrThruDoneMs - instrThruMs;
+		unsigned int us = 0xFFFF;
+		if(ms < 65)
+		{
+			int t0 = (int)instrThruDoneT0 - (int)instrThruT0;
+			us = (unsigned int)ms * 1000 + t0 * 4;
+		}
+		instrRecord(&instrThru, us);
+		instrThruState = INSTR_PROBE_IDLE;
+	}
+	if(instrRx2Ready)
+	{
+		instrRecord(&instrRx2, instrRx2Time >> 2); // 4 cycles per us
+		instrRx2Ready = 0;
+	}
+}
+
+////////////////////////////////////////////////////////////
+// SEND ONE SET OF STATISTICS AS A SYSEX MESSAGE
+// F0 7D 48 01 <which> <count> <min> <max> <mean> <hist x 8> F7
+void instrDump(byte which, INSTR_STAT *stat)
+{
+	send(0xF0);
+	send(SYSEX_MANUFACTURER);
+	send(SYSEX_DEVICE);
+	send(SYSEX_CMD_INSTR_DUMP);
+	send(which);
+	sendSysexWord(stat->count);
+	sendSysexWord(stat->min);
+	sendSysexWord(stat->max);
+	sendSysexWord(stat->count ? (stat->total / stat->count) : 0);
+	for(byte i=0; i<INSTR_HIST_BINS; ++i)
+		sendSysexWord(stat->hist[i]);
+	send(0xF7);
+}
+#endif
+
+////////////////////////////////////////////////////////////
+// ACT ON A SYSEX COMMAND ADDRESSED TO THE HUB
+void hubSysexCommand()
+{
+	switch(hubSysex[0])
+	{
+#ifdef INSTRUMENT
+		case SYSEX_CMD_INSTR_DUMP:
+			// replies are not sent in hardware thru mode as 
+			// they could get mixed in with thru data
+			if(!(_options & OPTION_HARDTHRU))
+			{
+				instrDump(0, &instrTickTx);
+				instrDump(1, &instrTickMain);
+				instrDump(2, &instrThru);
+				instrDump(3, &instrRx2);
+			}
+			break;
+		case SYSEX_CMD_INSTR_RESET:
+			instrClear(&instrTickTx);
+			instrClear(&instrTickMain);
+			instrClear(&instrThru);
+			instrClear(&instrRx2);
+			break;
+#endif
+		case SYSEX_CMD_FILTER:
+			// F0 7D 48 03 <type> <bits 0-6> <bits 7-13> <bits 14-15> F7
+			// type 0-7 is status 8n-Fn, and each bit passes one
+			// channel (or for type 7, one of F0-FF)
+			if(hubSysexIndex >= 2 + 5 && hubSysex[1] < 8)
+			{
+				unsigned int mask = hubSysex[2] | ((unsigned int)hubSysex[3] << 7) | ((unsigned int)hubSysex[4] << 14);
+				midiFilter[hubSysex[1] << 1] = (mask & 0xff);
+				midiFilter[(hubSysex[1] << 1) + 1] = (mask >> 8);
+				saveOptions();
+			}
+			break;
+		case SYSEX_CMD_FILTER_RESET:
+			for(byte i=0; i<SZ_FILTER; ++i)
+				midiFilter[i] = 0xFF;
+			saveOptions();
+			break;
+		case SYSEX_CMD_RATE_QUERY:
+			// F0 7D 48 05 <in bytes/s> <out bytes/s> <in msgs/s> F7
+			if(!(_options & OPTION_HARDTHRU))
+			{
+				send(0xF0);
+				send(SYSEX_MANUFACTURER);
+				send(SYSEX_DEVICE);
+				send(SYSEX_CMD_RATE_QUERY);
+				sendSysexWord(rxByteRate);
+				sendSysexWord(txByteRate);
+				sendSysexWord(rxMsgRate);
+				send(0xF7);
+			}
+			break;
+		default:
+			break;
+	}
+}
+
+////////////////////////////////////////////////////////////
+// TRACK MIDI MESSAGE BOUNDARIES IN THE THRU DATA
+// Returns nonzero if the byte should be passed on, which is
+// decided by the message filter for the status byte
+byte midiParse(byte q)
+{
+	// status byte
+	if(q & 0x80)
+	{
+		// the filter decides whether the message is passed on.
+		// The end of a sysex goes the same way as the start
+		if(!(0xF7 == q && midiInSysex))
+			midiBlock = !FILTER_PASS(q);
+		midiDiscard = 0;
+		midiParamIndex = 0;
+		midiMsgOpen = 1;
+		if(0xF0 == q)
+		{
+			// start of sysex
+			midiInSysex = 1;
+			midiStatus = 0;
+			midiNumParams = 0;
+			hubSysexIndex = 0;
+			hubSysexMatch = 0;
+		}
+		else if(q < 0xF0)
+		{
+			// channel message. Program change and channel
+			// pressure have one data byte, the rest have two
+			midiInSysex = 0;
+			midiStatus = q;
+			midiNumParams = ((q & 0xE0) == 0xC0) ? 1 : 2;
+		}
+		else
+		{
+			// system common message or end of sysex. These 
+			// cancel running status. If this is the end of a 
+			// sysex for the hub then it will be acted on once
+			// the F7 has been passed on
+			if(0xF7 == q && midiInSysex && hubSysexMatch && hubSysexIndex > 2)
+				hubSysexReady = 1;
+			midiInSysex = 0;
+			midiStatus = 0;
+			switch(q)
+			{
+				case 0xF1: // MTC quarter frame
+				case 0xF3: // song select
+					midiNumParams = 1; 
+					break;
+				case 0xF2: // song position pointer
+					midiNumParams = 2; 
+					break;
+				default:
+					midiNumParams = 0;
+					midiMsgOpen = 0;
+					break;
+			}
+		}
+		return !midiBlock;
+	}
+	
+	// data byte following lost input?
+	if(midiDiscard)
+		return 0;
+		
+	// sysex data. Check whether the message is addressed
+	// to the hub and hold on to the command bytes if so
+	if(midiInSysex)
+	{
+		if(0 == hubSysexIndex)
+			hubSysexMatch = (SYSEX_MANUFACTURER == q);
+		else if(1 == hubSysexIndex)
+			hubSysexMatch = hubSysexMatch && (SYSEX_DEVICE == q);
+		else if(hubSysexMatch && (hubSysexIndex - 2 < SZ_HUBSYSEX))
+			hubSysex[hubSysexIndex - 2] = q;
+		if(hubSysexIndex != 0xFF)
+			++hubSysexIndex;
+		return !midiBlock;
+	}
+		
+	// count data bytes of channel and system common messages
+	// so we know where each message ends. Once a channel
+	// message is complete the next one can use running status
+	midiMsgOpen = 0;
+	if(midiNumParams)
+	{
+		if(++midiParamIndex >= midiNumParams)
+		{
+			midiParamIndex = 0;
+			if(!midiStatus)
+				midiNumParams = 0;
+		}
+		else
+		{
+			midiMsgOpen = 1;
+		}
+	}
+	return !midiBlock;
+}
+
+////////////////////////////////////////////////////////////
+// GIVE UP ON THE MESSAGE IN PROGRESS
+// Used when input was lost or a message has stalled. If a 
+// sysex was in progress we end it here so the receiver does
+// not get the remainder of it joined on to the part we 
+// already sent. Any data bytes up to the next status byte
+// are thrown away. Part of a channel message may have gone out
+// too, so the next status byte is always sent in full
+void midiEndMessage()
+{
+	if(midiInSysex)
+	{
+		if(!(_options & OPTION_HARDTHRU) && (_options & OPTION_PASSOTHERMSG) && !midiBlock)
+			send(0xF7);
+		midiInSysex = 0;
+		if(sysexAbortCount != 0xFF)
+			++sysexAbortCount;
+	}
+	txRunningStatus = 0;
+	midiStatus = 0;
+	midiNumParams = 0;
+	midiDiscard = 1;
+	midiMsgOpen = 0;
+}
+
+////////////////////////////////////////////////////////////
+// SWITCH THE PARSER TO THE OTHER INPUT
+// Only done between messages, so the only state that each 
+// input needs to keep is its running status
+void midiSwitchInput()
+{
+	byte t = midiStatus;
+	midiStatus = midiOtherStatus;
+	midiOtherStatus = t;
+	t = midiDiscard;
+	midiDiscard = midiOtherDiscard;
+	midiOtherDiscard = t;
+	midiParamIndex = 0;
+	midiNumParams = 0;
+	midiBlock = 0;
+	if(midiStatus)
+	{
+		midiNumParams = ((midiStatus & 0xE0) == 0xC0) ? 1 : 2;
+		midiBlock = !FILTER_PASS(midiStatus);
+	}
+	midiInput ^= 1;
+}
+
+////////////////////////////////////////////////////////////
+// SEND THE MESSAGE HELD BACK BY THINNING, IF THERE IS ONE
+void thinFlush()
+{
+	if(!heldLen)
+		return;
+	if(!(heldMsg[0] == txRunningStatus && (_options & OPTION_RUNSTATUS)))
+		send(heldMsg[0]);
+	for(byte i=1; i<heldLen; ++i)
+		send(heldMsg[i]);
+	heldLen = 0;
+}
+
+////////////////////////////////////////////////////////////
+// A MESSAGE HAS BEEN COLLECTED FOR THINNING
+// It replaces the held message if that is the same control
+// change or pitch bend etc on the same channel. An LSB after
+// its MSB joins the held message as a running status pair, 
+// and a later LSB on its own just updates that pair. Anything 
+// else sends the held message and takes its place, except a 
+// controller that is not thinned, which goes straight out 
+// behind it
+void thinMessage()
+{
+	byte cc = ((thinMsg[0] & 0xF0) == 0xB0);
+	byte i;
+	if(cc && !THIN_CONTROLLER(thinMsg[1]))
+	{
+		thinFlush();
+		for(i=0; i<thinLen; ++i)
+			heldMsg[i] = thinMsg[i];
+		heldLen = thinLen;
+		thinFlush();
+		return;
+	}
+	if(heldLen && heldMsg[0] == thinMsg[0] && thinLen == 3 && cc)
+	{
+		if(heldLen >= 3 && heldMsg[1] < 32 && thinMsg[1] == heldMsg[1] + 32)
+		{
+			if(heldLen == 5 && thinCount != 0xFF)
+				++thinCount;
+			heldMsg[3] = thinMsg[1];
+			heldMsg[4] = thinMsg[2];
+			heldLen = 5;
+			return;
+		}
+		if(heldMsg[1] == thinMsg[1])
+		{
+			// a new MSB drops the held LSB too, as it
+			// resets the LSB at the receiver anyway
+			if(thinCount != 0xFF)
+				++thinCount;
+		}
+		else
+		{
+			thinFlush();
+		}
+	}
+	else if(heldLen == thinLen && heldMsg[0] == thinMsg[0] && !cc)
+	{
+		if(thinCount != 0xFF)
+			++thinCount;
+	}
+	else
+	{
+		thinFlush();
+	}
+	for(i=0; i<thinLen; ++i)
+		heldMsg[i] = thinMsg[i];
+	heldLen = thinLen;
+}
+
+////////////////////////////////////////////////////////////
+// GET THE PART OF THE NOTE MAP FOR A CHANNEL
+byte *noteMapChannel(byte chan)
+{
+	byte *map;
+	switch(chan >> 2)
+	{
+		case 0: map = noteMap0; break;
+		case 1: map = noteMap1; break;
+		case 2: map = noteMap2; break;
+		default: map = noteMap3; break;
+	}
+	return map + ((chan & 0x03) << 4);
+}
+
+////////////////////////////////////////////////////////////
+// TRACK A NOTE ON OR NOTE OFF THAT HAS BEEN PASSED ON
+void noteTrack(byte status, byte note, byte velocity)
+{
+	byte *map = noteMapChannel(status & 0x0F) + (note >> 3);
+	if((status & 0xF0) == 0x90 && velocity)
+		*map |= filterBit[note & 0x07];
+	else
+		*map &= ~filterBit[note & 0x07];
+}
+
+////////////////////////////////////////////////////////////
+// SEND NOTE OFF FOR EVERY NOTE THAT IS SOUNDING
+// Only called between messages, so that the note offs can't
+// get mixed up with a message being passed on
+void notePanic()
+{
+	for(byte chan=0; chan<16; ++chan)
+	{
+		byte *map = noteMapChannel(chan);
+		for(byte i=0; i<16; ++i)
+		{
+			byte bits = map[i];
+			if(!bits)
+				continue;
+			for(byte j=0; j<8; ++j)
+			{
+				if(bits & filterBit[j])
+				{
+					byte status = 0x80 | chan;
+					if(!(status == txRunningStatus && (_options & OPTION_RUNSTATUS)))
+						send(status);
+					send((i << 3) | j);
+					send(0);
+				}
+			}
+			map[i] = 0;
+		}
+	}
+}
+
+#if FEATURE_CLOCK
+////////////////////////////////////////////////////////////
+// SET THE SONG POSITION (IN 16THS)
+// From a song position pointer, which is only followed while
+// the clock is stopped. The next start carries on from here
+void setSongPosition(unsigned int pos)
+{
+	if(running)
+		return;
+	byte tick = (pos & 3) * 6;
+	byte beat = (pos >> 2) % _barLength;
+	intcon.7 = 0;
+	songPosition = pos;
+	resumeTick = tick;
+	resumeBeat = beat;
+	intcon.7 = 1;
+}
+
+////////////////////////////////////////////////////////////
+// SEND OUR SONG POSITION POINTER
+// Only called between messages. The ISR holds off sending
+// CONTINUE until the pointer has gone
+void sendSongPosition()
+{
+	intcon.7 = 0;
+	unsigned int pos = songPosition;
+	intcon.7 = 1;
+	send(0xF2);
+	send(pos & 0x7F);
+	send((pos >> 7) & 0x7F);
+	intcon.7 = 0;
+	sppTxEnd = txHead;
+	sppWait = (txTail != txHead);
+	intcon.7 = 1;
+}
+#endif
+
+////////////////////////////////////////////////////////////
+// RUN MIDI THRU
+// Messages from the two inputs are merged here. Between 
+// messages we take the next one from whichever input got 
+// its first byte first, then stay with that input until the 
+// message is complete
+void midiThru()
+{
+	// loop until there is no more data or
+	// we receive a full message
+	for(;;)
+	{
+		// choose the input for the next message
+		if(!midiMsgOpen)
+		{
+			// a panic goes out here, between messages. In hardware
+			// thru mode the rx ISR is already sending the input so
+			// this is not between messages on the output, and no
+			// notes are tracked anyway
+			if(panicPending)
+			{
+				panicPending = 0;
+				if(!(_options & OPTION_HARDTHRU))
+				{
+					thinFlush();
+					notePanic();
+				}
+			}
+#if FEATURE_CLOCK
+			// and so does our song position before a CONTINUE
+			if(sppPending)
+			{
+				thinFlush();
+				sendSongPosition();
+				sppPending = 0;
+			}
+#endif
+			
+			byte has1 = (rxHead != rxTail);
+			byte has2 = (rx2Head != rx2Tail);
+			byte input = midiInput;
+			if(has1 && has2)
+				input = ((signed char)(rx2Stamp[rx2Tail] - rxStamp[rxTail]) < 0);
+			else if(has1)
+				input = 0;
+			else if(has2)
+				input = 1;
+			if(input != midiInput)
+				midiSwitchInput();
+		}
+		
+		// have we reached a point where the rx ISR had to drop
+		// input? 
+		if(midiInput)
+		{
+			if(rx2Gap && (rx2Tail == rx2GapPos))
+			{
+				midiEndMessage();
+				rx2Gap = 0;
+			}
+		}
+		else if(rxGap && (rxTail == rxGapPos))
+		{
+			midiEndMessage();
+			rxGap = 0;
+		}
+		
+		// act on a sysex message for the hub, now that the
+		// whole message has been passed on
+		if(hubSysexReady)
+		{
+			hubSysexReady = 0;
+			hubSysexCommand();
+		}
+		
+#ifdef INSTRUMENT
+		// if we worked on the probe byte last time round but 
+		// didn't send it then the measurement is abandoned
+		if(INSTR_PROBE_CLAIMED == instrThruState)
+			instrThruState = INSTR_PROBE_IDLE;
+#endif
+		
+		// any data in the buffer?
+		if(midiInput ? (rx2Head == rx2Tail) : (rxHead == rxTail))
+		{
+			// no data ready. If we are part way through a message
+			// and the other input is waiting, don't hold it up 
+			// for ever
+			if(midiMsgOpen && !timerRunning(TIMER_MERGE) &&
+				(midiInput ? (rxHead != rxTail) : (rx2Head != rx2Tail)))
+			{
+				midiEndMessage();
+				continue;
+			}
+			
+			// nothing else is waiting so the held message, if 
+			// there is one, can't be replaced now
+			thinFlush();
+			return;
+		}
+		
+		// read the character out of buffer
+#ifdef INSTRUMENT
+		byte probe = 0;
+		if(!midiInput && (INSTR_PROBE_RX == instrThruState) && (rxTail == instrThruPos))
+		{
+			instrThruState = INSTR_PROBE_CLAIMED;
+			probe = 1;
+		}
+#endif
+		byte q;
+		if(midiInput)
+		{
+			q = rx2Buffer[rx2Tail];
+			rx2Tail = (rx2Tail + 1) & (SZ_RX2BUFFER - 1);
+		}
+		else
+		{
+			q = rxBuffer[rxTail];
+			rxTail = (rxTail + 1) & (SZ_RXBUFFER - 1);
+		}
+		startTimer(TIMER_MERGE, (midiInSysex || 0xF0 == q) ? MERGE_SYSEX_TIMEOUT : MERGE_TIMEOUT);
+
+		// a data byte with running status that starts a new
+		// message. If the output has a different running status
+		// here (a message from the other input or from the hub
+		// went out) then the status byte must be sent again
+		byte resendStatus = !(q & 0x80) && midiStatus && !midiParamIndex && !midiDiscard;
+
+		// keep track of where we are in the message
+		byte pass = midiParse(q);
+		
+#if FEATURE_CLOCK
+		// follow song position pointers from either input, 
+		// even if they are not passed on
+		if(0xF2 == q)
+		{
+			sppInIndex = 1;
+		}
+		else if(q & 0x80)
+		{
+			sppInIndex = 0;
+		}
+		else if(1 == sppInIndex)
+		{
+			sppInLo = q;
+			sppInIndex = 2;
+		}
+		else if(2 == sppInIndex)
+		{
+			setSongPosition(sppInLo | ((unsigned int)q << 7));
+			sppInIndex = 0;
+		}
+#endif
+		if(!pass)
+			continue;
+			
+		// MIDI realtime messages (e.g. clock) are forwarded 
+		// directly from the rx ISR and never get buffered, so
+		// if we are not passing non-realtime messages then 
+		// skip the byte
+		if(!(_options & OPTION_PASSOTHERMSG))
+			continue;
+			
+		// keep track of which notes are sounding downstream
+		if(!(q & 0x80) && (midiStatus & 0xE0) == 0x80 && !(_options & OPTION_HARDTHRU))
+		{
+			if(midiParamIndex)
+				noteNumber = q;
+			else
+				noteTrack(midiStatus, noteNumber, q);
+		}
+		
+		// in hardware thru mode the byte has already been 
+		// sent from the rx ISR, so we just animate the LEDs.
+		// We can't tell what running status the output has
+		if(_options & OPTION_HARDTHRU)
+		{
+			txRunningStatus = 0;
+			if(THRU_ANIMATE())
+				duty[q%6] = q%INITIAL_DUTY;
+			continue;
+		}
+		
+		// when thinning, collect up the message instead of 
+		// sending it. Thinning only starts at the beginning of
+		// a message, and never touches notes or sysex
+		if((q & 0x80) || resendStatus)
+		{
+			thinLen = 0;
+			if(THINNABLE(midiStatus) && (((txHead - txTail) & (SZ_TXBUFFER - 1)) >= THIN_HIGH_WATER))
+				thinMsg[thinLen++] = midiStatus;
+		}
+		if(thinLen)
+		{
+			if(!(q & 0x80) && thinLen < 3)
+				thinMsg[thinLen++] = q;
+			if(!midiMsgOpen)
+			{
+				thinMessage();
+				thinLen = 0;
+			}
+			ledFlicker = 1;
+			continue;
+		}
+		
+		// anything else has to go after the held message
+		thinFlush();
+		
+		if(resendStatus && (txRunningStatus != midiStatus))
+			send(midiStatus);
+		
+		// running status compression. If this is the same 
+		// channel status byte as the last one sent then we 
+		// can leave it out
+		if((q & 0x80) && (q == txRunningStatus) && (_options & OPTION_RUNSTATUS))
+			continue;
+		
+#ifdef INSTRUMENT
+		// the probe byte is about to go in the output buffer
+		if(probe)
+		{
+			instrThruPos = txHead;
+			instrThruState = INSTR_PROBE_TX;
+		}
+#endif
+		
+		// should we animate the LEDs based on thru traffic?
+		if(THRU_ANIMATE())
+		{
+			// animate and send
+			duty[q%6] = q%INITIAL_DUTY;
+			send(q);
+		}
+		// should we indicate thru traffic with flickering LEDs?
+		else 
+		{					
 			// flicker and send
-			P_LED2 = 1;
-			P_LED3 = 1;
+			ledFlicker = 1;
 			send(q);
-			P_LED2 = 0;
-			P_LED3 = 0;
 		}
-	}		
+	}		
+}
+
+////////////////////////////////////////////////////////////
+// UPDATE THE TRAFFIC RATES
+// Each rate is a rolling total where 1/8 of it is replaced
+// by the latest count every 125ms, so it settles on the 
+// number per second
+void updateRates()
+{
+	if(timerRunning(TIMER_RATE))
+		return;
+	startTimer(TIMER_RATE, RATE_PERIOD);
+	intcon.7 = 0;
+	unsigned int rx = rxByteCount;
+	unsigned int tx = txByteCount;
+	unsigned int msg = rxMsgCount;
+	rxByteCount = 0;
+	txByteCount = 0;
+	rxMsgCount = 0;
+	intcon.7 = 1;
+	rxByteRate = rxByteRate - (rxByteRate >> 3) + rx;
+	txByteRate = txByteRate - (txByteRate >> 3) + tx;
+	rxMsgRate = rxMsgRate - (rxMsgRate >> 3) + msg;
+	if(ratePeakHold)
+		--ratePeakHold;
+}
+
+#if FEATURE_TAP
+////////////////////////////////////////////////////////////
+// GET THE TIME OF A TAP IN 4us UNITS
+// Made up of the system ticks and the timer 0 count, as the
+// ISR latched them on the DEC button edge. If it didn't (the
+// button was never seen up) the time now is used. Not for use
+// by the ISR
+unsigned long getTapTime()
+{
+	intcon.7 = 0;
+	byte t0;
+	unsigned long ms;
+	if(TAP_STAMP_LATCHED == tapStampState)
+	{
+		t0 = tapStampT0;
+		ms = tapStampTicks;
+	}
+	else
+	{
+		t0 = tmr0;
+		ms = systemTicks;
+		if(intcon.2 && t0 < 128)
+		{
+			// timer 0 has rolled over but the ISR has not seen it
+			// yet, so it is counting from zero not the init value
+			++ms;
+			t0 += TIMER_0_INIT_SCALAR;
+		}
+	}
+	tapStampState = TAP_STAMP_IDLE;
+	intcon.7 = 1;
+	return (ms * 250) + (byte)(t0 - TIMER_0_INIT_SCALAR);
+}
+
+////////////////////////////////////////////////////////////
+// ADD AN INTERVAL TO THE TAP HISTORY
+void tapRecord(unsigned long interval)
+{
+	tapHistory[tapHistoryPos] = interval;
+	tapHistoryPos = (tapHistoryPos + 1) & (SZ_TAPHISTORY - 1);
+	if(tapHistoryCount < SZ_TAPHISTORY)
+		++tapHistoryCount;
+}
+
+////////////////////////////////////////////////////////////
+// ADD A TAP INTERVAL AND RETURN THE ESTIMATED INTERVAL
+// The estimate is the mean of the recent intervals with the
+// shortest and longest left out, which is the median when
+// there are three. An interval well away from the estimate 
+// (missed or extra tap) is ignored. When the next one is out 
+// as well, two that add up to about the estimate are an extra
+// tap and are put back together, otherwise two that agree with
+// each other mean the tempo really has changed
+unsigned long tapAddInterval(unsigned long interval)
+{
+	if(tapHistoryCount >= 2)
+	{
+		unsigned long tolerance = tapEstimate >> TAP_TOLERANCE_SHIFT;
+		if(interval + tolerance < tapEstimate || interval > tapEstimate + tolerance)
+		{
+			unsigned long last = tapOutlier;
+			tapOutlier = interval;
+			if(!last)
+				return tapEstimate;
+				
+			// if the split intervals keep coming it is twice 
+			// the tempo rather than extra taps
+			unsigned long sum = last + interval;
+			if(!tapMerged && sum + tolerance >= tapEstimate && sum <= tapEstimate + tolerance)
+			{
+				interval = sum;
+				tapMerged = 1;
+			}
+			else
+			{
+				unsigned long diff = (last > interval) ? (last - interval) : (interval - last);
+				if(diff > (interval >> TAP_AGREE_SHIFT))
+					return tapEstimate;
+				tapHistoryCount = 0;
+				tapRecord(last);
+				tapMerged = 0;
+			}
+		}
+		else
+		{
+			tapMerged = 0;
+		}
+	}
+	tapOutlier = 0;
+	tapRecord(interval);
+		
+	unsigned long total = 0;
+	unsigned long lo = 0xFFFFFFFF;
+	unsigned long hi = 0;
+	byte pos = tapHistoryPos;
+	for(byte i = 0; i < tapHistoryCount; ++i)
+	{
+		pos = (pos - 1) & (SZ_TAPHISTORY - 1);
+		unsigned long t = tapHistory[pos];
+		total += t;
+		if(t < lo)
+			lo = t;
+		if(t > hi)
+			hi = t;
+	}
+	if(tapHistoryCount < 3)
+		tapEstimate = total / tapHistoryCount;
+	else
+		tapEstimate = (total - lo - hi) / (tapHistoryCount - 2);
+	return tapEstimate;
 }
+#endif
 
 ////////////////////////////////////////////////////////////
-// SETUP THE TIMER FOR A SPECIFIC BPM
+// SETUP THE TIMER FOR A SPECIFIC BPM (IN TENTHS OF A BPM)
 void setBPM(int b)
 {
 	if(b < BPM_MIN)
@@ -341,6 +2578,7 @@ void setBPM(int b)
 	else if(b > BPM_MAX)
 		b = BPM_MAX;
 	_bpm = b;
+#if FEATURE_CLOCK
 /*
 	beats per second = bpm / 60 
 	midi ticks per second = 24 * (bpm / 60)	
@@ -348,25 +2586,365 @@ void setBPM(int b)
 		= (timer counts per second)/(24 * (bpm / 60))
 		= (timer counts per second/24)/(bpm / 60)
 		= 60 * (timer counts per second/24)/bpm
-	timer init scalar = 65536 - timer counts per MIDI tick	
+		= 600 * (timer counts per second/24)/(bpm x 10)
+	The remainder of the division is kept so the ISR can
+	spread it over the ticks
 */
 	#define TIMER_COUNTS_PER_SECOND (unsigned long)500000
-	unsigned long x = (60 * TIMER_COUNTS_PER_SECOND)/24;
-	x = x / _bpm;
-	timer_init_scalar = 65535 - x;
+	unsigned long x = (600 * TIMER_COUNTS_PER_SECOND)/24;
+	unsigned int period = x / _bpm;
+	unsigned int rem = x % _bpm;
+	
+	// the ISR uses these so don't let it see half an update
+	intcon.7 = 0;
+	tickPeriod = period;
+	tickPeriodRem = rem;
+	tickPeriodDiv = _bpm;
+	if(tickPhase >= tickPeriodDiv)
+		tickPhase = 0;
+	intcon.7 = 1;
+	
+	// with swing the ticks come from the groove table. Each 
+	// 8th note is 12 ticks, the first 6 taking the swing share
+	// of the time. Working from the time of each tick within
+	// the 8th note means the rounding never builds up inside 
+	// it, and the remainder of the 8th note itself is carried
+	// by the ISR. The table is kept up to date even with no 
+	// swing so that it is always safe for the ISR to use
+	unsigned long eighth = (12 * x) / _bpm;
+	rem = (12 * x) % _bpm;
+	intcon.7 = 0;
+	grooveRem = rem;
+	intcon.7 = 1;
+	unsigned long first = (eighth * SWING_PERCENT(_swing)) / 100;
+	unsigned long last = 0;
+	for(byte i=1; i<=12; ++i)
+	{
+		unsigned long t;
+		if(i <= 6)
+			t = (first * i) / 6;
+		else
+			t = first + ((eighth - first) * (i - 6)) / 6;
+		period = t - last;
+		last = t;
+		intcon.7 = 0;
+		grooveTable[i - 1] = period;
+		grooveTable[i + 11] = period;
+		intcon.7 = 1;
+	}
+#endif
+}
+
+#if FEATURE_MENU
+////////////////////////////////////////////////////////////
+// GET THE OPTIONS BIT CONTROLLED BY A MENU ITEM
+// Items 0-4 are the first five option bits, item 5 is
+// the brightness setting and items 6-8 carry on from bit 5.
+// Item 9 is the first bit of _options2, item 10 is the
+// clock ratio setting and item 11 is the swing setting.
+// Item 12 is bit 1 of _options2, item 13 is the bar length
+// and item 14 is the clock offset
+byte menuOptionMask(byte item)
+{
+	if(item < 5)
+		return 1<<item;
+	if(item < 9)
+		return 1<<(item-1);
+	if(item < 12)
+		return 1<<(item-9);
+	return 1<<(item-11);
+}
+
+////////////////////////////////////////////////////////////
+// CHECK WHETHER THE OPTION FOR A MENU ITEM IS SWITCHED ON
+byte menuItemOn(byte item)
+{
+	if(MENU_ITEM_CLOCK_RATIO == item)
+		return (CLOCK_RATIO_X1 != _clockRatio);
+	if(MENU_ITEM_SWING == item)
+		return !!_swing;
+	if(MENU_ITEM_BAR_LENGTH == item)
+		return (_barLength > 1);
+	if(MENU_ITEM_CLOCK_OFFSET == item)
+		return !!_clockOffset;
+	if(item < 9)
+		return !!(_options & menuOptionMask(item));
+	return !!(_options2 & menuOptionMask(item));
+}
+
+////////////////////////////////////////////////////////////
+// SWITCH THE OPTION FOR A MENU ITEM ON OR OFF
+void menuItemToggle(byte item)
+{
+	if(item < 9)
+		_options ^= menuOptionMask(item);
+	else
+		_options2 ^= menuOptionMask(item);
+}
+
+////////////////////////////////////////////////////////////
+// GET ONE OF THE ERROR COUNTERS FOR DISPLAY
+byte getStat(byte which)
+{
+	switch(which)
+	{
+		case 0: return rxDropCount;
+		case 1: return rxOverrunCount;
+		case 2: return txDropCount;
+		case 3: return sysexAbortCount;
+		case 4: return lateTickCount;
+		default: return thinCount;
+	}
+}
+
+////////////////////////////////////////////////////////////
+// RESET ONE OF THE ERROR COUNTERS
+void clearStat(byte which)
+{
+	switch(which)
+	{
+		case 0: rxDropCount = 0; break;
+		case 1: rxOverrunCount = 0; break;
+		case 2: txDropCount = 0; break;
+		case 3: sysexAbortCount = 0; break;
+		case 4: lateTickCount = 0; break;
+		default: thinCount = 0; break;
+	}
 }
+#endif
 
 ////////////////////////////////////////////////////////////
 // SHOW VERSION
+// The main loop keeps this on the LEDs while TIMER_VERSION 
+// runs. Without the LED refresh the LEDs are set directly
 void showVersion()
 {
+#if FEATURE_LEDS
+	duty[0] = (FIRMWARE_VERSION&0x20) ? PWM_MAX : 0;
+	duty[1] = (FIRMWARE_VERSION&0x10) ? PWM_MAX : 0;
+	duty[2] = (FIRMWARE_VERSION&0x08) ? PWM_MAX : 0;
+	duty[3] = (FIRMWARE_VERSION&0x04) ? PWM_MAX : 0;
+	duty[4] = (FIRMWARE_VERSION&0x02) ? PWM_MAX : 0;
+	duty[5] = (FIRMWARE_VERSION&0x01) ? PWM_MAX : 0;
+#else
 	P_LED0 = !!(FIRMWARE_VERSION&0x20);
 	P_LED1 = !!(FIRMWARE_VERSION&0x10);
 	P_LED2 = !!(FIRMWARE_VERSION&0x08);
 	P_LED3 = !!(FIRMWARE_VERSION&0x04);
 	P_LED4 = !!(FIRMWARE_VERSION&0x02);
 	P_LED5 = !!(FIRMWARE_VERSION&0x01);
-	delay_s(5);
+#endif
+}
+
+#if FEATURE_LEDS
+////////////////////////////////////////////////////////////
+// SET ALL THE LEDS FROM BIT MASKS
+// LEDs in the bright mask are set to brightDuty, the others in 
+// the dim mask to dimDuty and the rest are turned off
+void setLEDs(byte bright, byte brightDuty, byte dim, byte dimDuty)
+{
+	byte mask = 1;
+	for(byte i=0; i<6; ++i)
+	{
+		if(bright & mask)
+			duty[i] = brightDuty;
+		else if(dim & mask)
+			duty[i] = dimDuty;
+		else
+			duty[i] = 0;
+		mask <<= 1;
+	}
+}
+#endif
+
+////////////////////////////////////////////////////////////
+// GET THE CHECK BYTE FOR A SETTINGS RECORD
+// Covers the filter table too, given as the XOR of its bytes
+byte settingsCheck(byte *rec, byte filterCheck)
+{
+	byte check = EEPROM_MAGIC_COOKIE ^ filterCheck;
+	for(byte i=0; i<SETTINGS_CHECK; ++i)
+		check ^= rec[i];
+	return check;
+}
+
+////////////////////////////////////////////////////////////
+// WRITE THE SETTINGS TO EEPROM A BYTE AT A TIME
+// Called from the main loop. Rather than waiting for each 
+// EEPROM write to complete we start it and come back later, 
+// so MIDI thru carries on while we are saving. The filter 
+// table goes first, only writing bytes that have changed, then
+// the record. The check byte is written last so that a record
+// is not valid until complete
+void serviceSettings()
+{
+	// write in progress?
+	if(settingsWritePos < SZ_FILTER + SZ_SETTINGS)
+	{
+		if(eecon1.1) // WR
+			return;
+		byte addr;
+		byte data;
+		if(settingsWritePos < SZ_FILTER)
+		{
+			addr = EEPROM_ADDR_FILTER + ((settingsSlot & 1) ? SZ_FILTER : 0) + settingsWritePos;
+			data = midiFilter[settingsWritePos];
+			if(eeprom_read(addr) == data)
+			{
+				++settingsWritePos;
+				return;
+			}
+		}
+		else
+		{
+			addr = EEPROM_ADDR_SLOTS + settingsSlot * SZ_SETTINGS + settingsWritePos - SZ_FILTER;
+			data = settingsRecord[settingsWritePos - SZ_FILTER];
+		}
+		eeadrl = addr;
+		eedatl = data;
+		eecon1.7 = 0; // EEPGD, data EEPROM
+		eecon1.6 = 0; // CFGS
+		eecon1.2 = 1; // WREN
+		intcon.7 = 0;
+		eecon2 = 0x55;
+		eecon2 = 0xAA;
+		eecon1.1 = 1; // WR
+		intcon.7 = 1;
+		++settingsWritePos;
+		return;
+	}
+	if(eecon1.1)
+		return;
+	eecon1.2 = 0;
+	
+	// tempo and mode changes are saved too, but as they can 
+	// change in lots of places we look for them here. A build
+	// without the clock keeps the mode that was saved. While we
+	// follow an external clock the tempo changes all the time, so 
+	// it is only saved once the clock has gone away
+	byte mode = settingsMode;
+	int bpm = _bpm;
+#if FEATURE_CLOCK
+	if(MODE_STEP == _mode || MODE_TAP == _mode || MODE_NOCLOCK == _mode)
+		mode = _mode;
+	if(runLock != settingsRunLock)
+	{
+		settingsRunLock = runLock;
+		saveOptions();
+	}
+	if(SLAVE_IDLE != slaveState)
+		bpm = settingsBPM;
+#endif
+	if(bpm != settingsBPM || mode != settingsMode)
+	{
+		settingsBPM = bpm;
+		settingsMode = mode;
+		saveOptions();
+	}
+	
+	// time to start a save?
+	if(settingsDirty && !timerRunning(TIMER_SAVE))
+	{
+		settingsRecord[SETTINGS_SEQ]++;
+		settingsRecord[SETTINGS_OPTIONS] = _options;
+		settingsRecord[SETTINGS_OPTIONS2] = _options2 | ((_barLength - 1) << OPTIONS2_BAR_SHIFT) | 
+			((_clockOffset << OPTIONS2_OFFSET_SHIFT) & OPTIONS2_OFFSET_MASK);
+		settingsRecord[SETTINGS_CLOCK_RATIO] = (_swing << 4) | _clockRatio;
+		settingsRecord[SETTINGS_BPM_LO] = (settingsBPM & 0xff);
+		settingsRecord[SETTINGS_BPM_HI] = (settingsBPM >> 8);
+		settingsRecord[SETTINGS_MODE] = (settingsMode << 4) | (settingsRunLock ? SETTINGS_MODE_RUNLOCK : 0) | _brightness;
+		byte filterCheck = 0;
+		for(byte i=0; i<SZ_FILTER; ++i)
+			filterCheck ^= midiFilter[i];
+		settingsRecord[SETTINGS_CHECK] = settingsCheck(settingsRecord, filterCheck);
+		settingsSlot = (settingsSlot + 1) & (EEPROM_NUM_SLOTS - 1);
+		settingsWritePos = 0;
+		settingsDirty = 0;
+	}
+}
+
+////////////////////////////////////////////////////////////
+// LOAD OPTIONS FROM EEPROM
+// This is done first thing at power up, so it only reads 
+// the settings. The saved tempo is left in settingsBPM for 
+// main() to set up once the thru is running
+void loadOptions()
+{
+	// find the latest valid record. That is the one where the
+	// following slot does not carry on the sequence
+	byte found = 0;
+	byte rec[SZ_SETTINGS];
+	for(byte slot=0; slot<EEPROM_NUM_SLOTS; ++slot)
+	{
+		byte addr = EEPROM_ADDR_SLOTS + slot * SZ_SETTINGS;
+		for(byte i=0; i<SZ_SETTINGS; ++i)
+			rec[i] = eeprom_read(addr + i);
+		byte filterCheck = 0;
+		addr = EEPROM_ADDR_FILTER + ((slot & 1) ? SZ_FILTER : 0);
+		for(byte i=0; i<SZ_FILTER; ++i)
+			filterCheck ^= eeprom_read(addr + i);
+		if(rec[SETTINGS_CHECK] != settingsCheck(rec, filterCheck))
+			continue;
+		if(found && (byte)(rec[SETTINGS_SEQ] - settingsRecord[SETTINGS_SEQ]) > EEPROM_NUM_SLOTS)
+			continue;
+		for(byte i=0; i<SZ_SETTINGS; ++i)
+			settingsRecord[i] = rec[i];
+		settingsSlot = slot;
+		found = 1;
+	}
+	if(found)
+	{
+		_options = settingsRecord[SETTINGS_OPTIONS];
+		_options2 = settingsRecord[SETTINGS_OPTIONS2] & ~(OPTIONS2_BAR_MASK|OPTIONS2_OFFSET_MASK);
+		_barLength = (settingsRecord[SETTINGS_OPTIONS2] >> OPTIONS2_BAR_SHIFT) + 1;
+		if(_barLength > NUM_BAR_LENGTHS)
+			_barLength = 1;
+		
+		// the offset is signed, so fill in the top bits
+		byte o = (settingsRecord[SETTINGS_OPTIONS2] & OPTIONS2_OFFSET_MASK) >> OPTIONS2_OFFSET_SHIFT;
+		if(o & 0x04)
+			o |= 0xF8;
+		setClockOffset((signed char)o);
+		settingsBPM = ((int)settingsRecord[SETTINGS_BPM_HI] << 8) | settingsRecord[SETTINGS_BPM_LO];
+		settingsMode = settingsRecord[SETTINGS_MODE] >> 4;
+		if(settingsMode > MODE_NOCLOCK)
+			settingsMode = MODE_STEP;
+		settingsRunLock = !!(settingsRecord[SETTINGS_MODE] & SETTINGS_MODE_RUNLOCK);
+		_brightness = settingsRecord[SETTINGS_MODE] & 0x07;
+		if(_brightness >= NUM_BRIGHTNESS_LEVELS)
+			_brightness = 0;
+		_mode = settingsMode;
+#if FEATURE_CLOCK
+		runLock = settingsRunLock;
+#endif
+		setClockRatio(settingsRecord[SETTINGS_CLOCK_RATIO] & 0x0F);
+		_swing = settingsRecord[SETTINGS_CLOCK_RATIO] >> 4;
+		if(_swing >= NUM_SWING_LEVELS)
+			_swing = 0;
+		byte addr = EEPROM_ADDR_FILTER + ((settingsSlot & 1) ? SZ_FILTER : 0);
+		for(byte i=0; i<SZ_FILTER; ++i)
+			midiFilter[i] = eeprom_read(addr + i);
+		return;
+	}
+	settingsBPM = BPM_DEFAULT;
+	
+	// "magic cookie" is a known value written to the EEPROM
+	// with each valid save. Makes sure we can avoid reading
+	// garbage from EEPROM when there is no previous save
+	_options = eeprom_read(EEPROM_ADDR_OPTIONS);
+	if(eeprom_read(EEPROM_ADDR_MAGIC_COOKIE) != EEPROM_MAGIC_COOKIE)
+		_options = OPTIONS_DEFAULT; 
+		
+	// the second options byte has its own cookie since it 
+	// was added later
+	_options2 = eeprom_read(EEPROM_ADDR_OPTIONS2) & ~(OPTIONS2_BAR_MASK|OPTIONS2_OFFSET_MASK);
+	_clockRatio = eeprom_read(EEPROM_ADDR_CLOCK_RATIO);
+	if(eeprom_read(EEPROM_ADDR_MAGIC_COOKIE2) != EEPROM_MAGIC_COOKIE)
+	{
+		_options2 = OPTIONS2_DEFAULT; 
+		_clockRatio = CLOCK_RATIO_X1;
+	}
+	setClockRatio(_clockRatio);
 }
 
 ////////////////////////////////////////////////////////////
@@ -374,32 +2952,22 @@ void showVersion()
 void main()
 { 
 	// initialise app variables
-	byte running = 0;
-	byte tickCount = 0;
 	byte lastButtonStatus = 0;
-	unsigned long autoRepeatBegin = 0;
-	unsigned long nextAutoRepeat = 0;
-	unsigned long nextFade = 0;
-	unsigned long debouncePeriodEnd = 0;
-	unsigned long lastTapSystemTicks = 0;
-	unsigned long firstTapSystemTicks = 0;
-	unsigned long tapPeriodAccumulator = 0;
-	unsigned long menuLoopCount = 0;
-	byte tapCount = 0;
+	byte longPress = 0;
+	byte incDecPending = 0;
+	byte showingVersion = 0;
+#if FEATURE_MENU
+	byte menuFlash = 0;
 	byte menuOption = 0;
-	byte runLock = 0;
-	byte midiRestart = 0;
-	
-	// initialise brightness levels
-	brightnessLevels[0] = 50;
-	brightnessLevels[1] = 20;
-	brightnessLevels[2] = 10;
-	brightnessLevels[3] = 5;
-	brightnessLevels[4] = 2;
-	brightnessLevels[5] = 1;
-	byte maxDuty = brightnessLevels[0];
-	byte pwm=0;	
-	duty[0] = duty[1] = duty[2] = duty[3] = duty[4] = duty[5] = 0;
+	byte statsIndex = 0;
+#endif
+#if FEATURE_TAP
+	unsigned long lastTapTime = 0;
+	byte tapCount = 0;
+#endif
+#if FEATURE_CLOCK
+	byte slaveFollow = 0;
+#endif
 	
 	// osc control / 16MHz / internal
 	osccon = 0b01111010;
@@ -412,28 +2980,20 @@ void main()
 	porta=0;
 	portc=0;
 
-	// Version display
-	if(!P_RUN)
-		showVersion();
+	// load options. The thru needs these so they come first,
+	// and the hub comes back up in the mode it was left in
+	_mode = MODE_HOME;
+	loadOptions();
+#if !FEATURE_CLOCK
+	_mode = MODE_HOME;
+#elif !FEATURE_TAP
+	if(MODE_TAP == _mode)
+		_mode = MODE_STEP;
+#endif
 		
 	// initialise MIDI comms
 	initUSART();
 
-	// setup default BPM
-	setBPM(BPM_DEFAULT);
-
-	// Configure timer 1 (controls tempo)
-	// Input 4MHz
-	// Prescaled to 500KHz
-	tmr1l = 0;	 // reset timer count register
-	tmr1h = 0;
-	t1con.7 = 0; // } Fosc/4 rate
-	t1con.6 = 0; // }
-	t1con.5 = 1; // } 1:8 prescale
-	t1con.4 = 1; // }
-	t1con.0 = 1; // timer 1 on
-	pie1.0 = 1;  // timer 1 interrupt enable
-	
 	// Configure timer 0 (controls systemticks)
 	// 	timer 0 runs at 4MHz
 	// 	prescaled 1/16 = 250kHz
@@ -447,151 +3007,390 @@ void main()
 	intcon.5 = 1; 	  // enabled timer 0 interrrupt
 	intcon.2 = 0;     // clear interrupt fired flag
 	
-	// enable interrupts	
+	// Configure interrupt on change for DEC and INC (RA4, RA5)
+	// 	both edges so we see presses and releases
+	iocap.4 = 1;
+	iocap.5 = 1;
+	iocan.4 = 1;
+	iocan.5 = 1;
+	
+	// Configure the second MIDI input (RA3)
+	// 	weak pull up so that it idles high with nothing 
+	// 	connected, falling edge IOC for the start bit and 
+	// 	timer 4 from the instruction clock to time the bits
+	wpua = 0b00001000;
+	option_reg.7 = 0; // weak pull ups enabled
+	iocan.3 = 1;
+	t4con = 0b00000000; // off, 1:1 prescale and postscale
+	pie3.1 = 1; // timer 4 interrupt enable
+	
+	iocaf = 0;
+	intcon.3 = 1;	  // IOCIE
+	
+	// enable interrupts. MIDI is received from here on, so 
+	// the rest of the setup has to be done before the receive
+	// buffer can fill (about 20ms of input)
 	intcon.7 = 1; //GIE
 	intcon.6 = 1; //PEIE
 
-	// default operating mode is clock/step control
-	_mode = MODE_STEP;
+	// Version display. This is shown from the main loop so the
+	// thru keeps running, and RUN is taken as already pressed
+	// so that holding it here does not start the clock
+	if(!P_RUN)
+	{
+		showingVersion = 1;
+		startTimer(TIMER_VERSION, VERSION_DISPLAY_TIME);
+		lastButtonStatus = M_BUTTON_RUN;
+		longPress = 1;
+#if !FEATURE_LEDS
+		showVersion();
+#endif
+	}
+	
+	// set up the saved tempo
+	setBPM(settingsBPM);
+	settingsBPM = _bpm;
+
+#ifdef INSTRUMENT
+	instrClear(&instrTickTx);
+	instrClear(&instrTickMain);
+	instrClear(&instrThru);
+	instrClear(&instrRx2);
+#endif	
 
-	// load options
-	loadOptions();
+#if FEATURE_CLOCK
+	// Configure timer 1 (controls tempo)
+	// Input 4MHz
+	// Prescaled to 500KHz
+	tmr1l = 0;	 // reset timer count register
+	tmr1h = 0;
+	t1con.7 = 0; // } Fosc/4 rate
+	t1con.6 = 0; // }
+	t1con.5 = 1; // } 1:8 prescale
+	t1con.4 = 1; // }
+	t1con.0 = 1; // timer 1 on
+	
+	// Configure CCP1 (ends each tempo tick)
+	// 	compare mode with special event trigger, which
+	// 	resets timer 1 when it reaches the tick period
+	ccpr1l = ((tickPeriod-1) & 0xff);
+	ccpr1h = ((tickPeriod-1) >> 8);
+	ccp1con = 0b00001011;
+	pie1.2 = 1;  // CCP1 interrupt enable
+	
+	// Configure CCP2 (times multiplied clock ticks)
+	// 	compare mode generating a software interrupt only, 
+	// 	enabled by the CCP1 ISR when it is needed
+	ccp2con = 0b00001010;
+	pir2.0 = 0;
+	
+	// if the clock was locked running when the settings were
+	// saved then it starts running again straight away, with
+	// a START at the first beat so that everything downstream
+	// picks up in time
+	if(runLock && MODE_NOCLOCK != _mode)
+	{
+		if(_options & OPTION_STARTSTOP)
+			midiRestart = 1;
+		running = 1;
+	}
+#endif
+	
+#if FEATURE_LEDS
+	// initialise brightness levels
+	brightnessLevels[0] = 63;
+	brightnessLevels[1] = 25;
+	brightnessLevels[2] = 13;
+	brightnessLevels[3] = 6;
+	brightnessLevels[4] = 3;
+	brightnessLevels[5] = 1;
+	byte maxDuty = brightnessLevels[_brightness];
+	duty[0] = duty[1] = duty[2] = duty[3] = duty[4] = duty[5] = 0;
+	
+	// Configure timer 2 (controls LED refresh)
+	// 	timer 2 runs at 4MHz
+	// 	prescaled 1/64 = 62.5kHz
+	// 	period is set by the ISR for each duty bit
+	tmr2 = 0;
+	pr2 = (1 << LED_PLANE_SHIFT) - 1;
+	t2con.6 = 0; // }
+	t2con.5 = 0; // } 1:1 postscale
+	t2con.4 = 0; // }
+	t2con.3 = 0; // }
+	t2con.1 = 1; // } 1:64 prescale
+	t2con.0 = 1; // }
+	t2con.2 = 1; // timer 2 on
+	pie1.1 = 1;  // timer 2 interrupt enable
+#else
+	// nothing to show, so the LED refresh is not running
+	if(!showingVersion)
+		P_LED0 = 1;
+#endif
 	
 	// App loop
 	for(;;)
 	{	
 				
+		// count down the software timers
+		serviceTimers();
+		
 		// run midi thru
 		midiThru();
 		
+		// save any changed settings
+		serviceSettings();
+		
+		// keep the traffic rates up to date
+		updateRates();
+		
+#ifdef INSTRUMENT
+		instrUpdate();
+#endif
+
+#if !FEATURE_LEDS
+		// back to the power light after the version display
+		if(showingVersion && !timerRunning(TIMER_VERSION))
+		{
+			P_LED0 = 1;
+			P_LED1 = 0;
+			P_LED2 = 0;
+			P_LED3 = 0;
+			P_LED4 = 0;
+			P_LED5 = 0;
+			showingVersion = 0;
+		}
+#endif
+
+#if FEATURE_CLOCK
+		// FOLLOWING AN EXTERNAL CLOCK
+		// keep the BPM in line with the external clock, so that
+		// when it goes away we carry on at the same tempo. The 
+		// divide is slow so it is only done for a new period
+		if(SLAVE_LOCKED == slaveState)
+		{
+			if(slavePeriodNew)
+			{
+				intcon.7 = 0;
+				unsigned long p = slavePeriod;
+				slavePeriodNew = 0;
+				intcon.7 = 1;
+				_bpm = (3200000000UL / p); // (600 * 500000 / 24) * 256 / p
+			}
+			slaveFollow = 1;
+		}
+		else if(slaveFollow && SLAVE_IDLE == slaveState)
+		{
+			setBPM(_bpm);
+			slaveFollow = 0;
+		}
+#endif
+		
+#if FEATURE_MENU
+		// flash for the selected item in menus
+		if(!timerRunning(TIMER_FLASH))
+		{
+			menuFlash = !menuFlash;
+			startTimer(TIMER_FLASH, menuFlash ? MENU_FLASH_ON : MENU_FLASH_OFF);
+		}
+#endif
+		
+#if FEATURE_LEDS
+		// VERSION DISPLAY
+		if(showingVersion)
+		{
+			showVersion();
+			if(!timerRunning(TIMER_VERSION))
+				showingVersion = 0;
+		}
+		else
+#endif
+#if FEATURE_MENU
 		// RUNNING MENU
 		if(MODE_MENU == _mode)
 		{
-			menuLoopCount++;
-			byte flash = ((menuLoopCount & 0xF00) == 0x100);
-			duty[0] = (flash && (menuOption == 0)) ? PWM_MAX : ((_options & (1<<0)) ? PWM_DIM : 0);
-			duty[1] = (flash && (menuOption == 1)) ? PWM_MAX : ((_options & (1<<1)) ? PWM_DIM : 0);
-			duty[2] = (flash && (menuOption == 2)) ? PWM_MAX : ((_options & (1<<2)) ? PWM_DIM : 0);
-			duty[3] = (flash && (menuOption == 3)) ? PWM_MAX : ((_options & (1<<3)) ? PWM_DIM : 0);
-			duty[4] = (flash && (menuOption == 4)) ? PWM_MAX : ((_options & (1<<4)) ? PWM_DIM : 0);
-			duty[5] = maxDuty;
+			byte flash = menuFlash;
+			if(menuOption < 6)
+			{
+				// first page. The first five options are the low
+				// bits of _options, and the last LED shows the
+				// brightness setting
+				setLEDs(flash ? (1 << menuOption) & 0x1F : 0, PWM_MAX, _options & 0x1F, PWM_DIM);
+				duty[5] = maxDuty;
+			}
+			else
+			{
+				// second and third pages of options. The selected
+				// option blinks off rather than on so that they 
+				// can be told apart from the first page
+				byte page = (menuOption < 12) ? 6 : 12;
+				byte sel;
+				byte on = 0;
+				if(MENU_ITEM_CLOCK_RATIO == menuOption)
+				{
+					// the clock ratio shows the selected
+					// ratio instead, from /4 up to x4
+					sel = 1 << _clockRatio;
+					on = 1 << CLOCK_RATIO_X1;
+				}
+				else if(MENU_ITEM_SWING == menuOption)
+				{
+					// likewise the swing amount, from none
+					// up to 70%
+					sel = 1 << _swing;
+					on = 0x01;
+				}
+				else if(MENU_ITEM_BAR_LENGTH == menuOption)
+				{
+					// and the bar length, from 1 to 6 beats
+					sel = 1 << (_barLength - 1);
+					on = 0x01;
+				}
+				else if(MENU_ITEM_CLOCK_OFFSET == menuOption)
+				{
+					// and the clock offset, from the latest 
+					// to the earliest with no offset dim
+					sel = 1 << (_clockOffset - CLOCK_OFFSET_MIN);
+					on = 1 << (0 - CLOCK_OFFSET_MIN);
+				}
+				else
+				{
+					sel = 1 << (menuOption - page);
+					for(byte i=0; i<6 && page + i < MENU_SIZE; ++i)
+						if(menuItemOn(page + i))
+							on |= (1 << i);
+				}
+				setLEDs(flash ? 0 : sel, PWM_MAX, on & ~sel, PWM_DIM);
+			}
+		}
+		else 
+		// ERROR COUNTER DISPLAY
+		if(MODE_STATS == _mode)
+		{
+			// the LED for the selected counter flashes like
+			// in the menu, and the count is shown as a dim bar
+			// with one more LED lit for each doubling
+			byte flash = menuFlash;
+			byte count = getStat(statsIndex);
+			byte level = 0;
+			while(count && level < 6)
+			{
+				++level;
+				count >>= 1;
+			}
+			setLEDs(flash ? (1 << statsIndex) : 0, PWM_MAX, (1 << level) - 1, PWM_DIM);
 		}
 		else 
+#endif
+#if FEATURE_ANIMATE
 		// SPLIT-ONLY MODE
 		if(MODE_NOCLOCK == _mode)
 		{
+			if(_options2 & OPTION2_RATEMETER)
+			{
+				// show how busy the busier of the input and 
+				// output links is, as a bar with one LED for
+				// each sixth of the link capacity (any traffic
+				// at all lights the first) and a brighter LED 
+				// for the recent peak
+				unsigned int rate = (rxByteRate > txByteRate) ? rxByteRate : txByteRate;
+				byte level = 0;
+				while(level < 6 && rate > (unsigned int)level * (LINK_BYTES_PER_SEC / 6))
+					++level;
+				if(level >= ratePeak || !ratePeakHold)
+				{
+					ratePeak = level;
+					ratePeakHold = RATE_PEAK_HOLD;
+				}
+				setLEDs(ratePeak ? (1 << (ratePeak - 1)) : 0, maxDuty, (1 << level) - 1, (maxDuty >> 2) + 1);
+			}
+			else
 			// animation is driven from MIDI thru function,
 			// but we'll fade the LEDs in this main loop
-			if(systemTicks > nextFade)
+			if(!timerRunning(TIMER_FADE))
 			{
 				for(byte i=0;i<6;++i) 
 					if(duty[i]) 
 						--duty[i];
-				nextFade = systemTicks + FADE_PERIOD;
+				startTimer(TIMER_FADE, FADE_PERIOD);
 			}			
 		}
+#elif FEATURE_LEDS
+		// SPLIT-ONLY MODE
+		// without the animation there is just the power light
+		if(MODE_NOCLOCK == _mode)
+		{
+			setLEDs(0x01, maxDuty, 0, 0);
+		}
+#endif
+#if FEATURE_CLOCK
 		else
 		// STEP/TAP MODE
-		if(tick_flag)
+		if(ticksPending)
 		{
-			tick_flag = 0;	
-			if(++tickCount > 23)
+			// the clock itself is sent by the ISR, so no ticks
+			// are lost if we are slow getting here. We just
+			// update the display, and count the ticks that went
+			// by without us seeing them
+			intcon.7 = 0;
+			byte ticks = ticksPending;
+			ticksPending = 0;
+			intcon.7 = 1;
+			if(ticks > 1)
 			{
-				if(midiRestart)
-				{
-					send(MIDI_SYNCH_START);
-					midiRestart = 0;
-				}
-				tickCount = 0;
+				ticks = ticks - 1;
+				lateTickCount = (lateTickCount > 0xFF - ticks) ? 0xFF : lateTickCount + ticks;
 			}
-			if(running)
-				send(MIDI_SYNCH_TICK);
+#ifdef INSTRUMENT
+			unsigned int sinceTick;
+			READ_TIMER1(sinceTick);
+			instrRecord(&instrTickMain, sinceTick << 1);
+#endif
 		
+#if FEATURE_TAP
 			// mid-tap entry?
 			if(tapCount)
 			{
 				// illuminate LEDs for tap tempo entry
-				duty[0] = PWM_MAX;
-				duty[1] = (tapCount > 1) ? maxDuty : 0;
-				duty[2] = (tapCount > 2) ? maxDuty : 0;
-				duty[3] = (tapCount > 3) ? maxDuty : 0;
-				duty[4] = (tapCount > 4) ? maxDuty : 0;
-				duty[5] = (tapCount > 5) ? maxDuty : 0;
+				setLEDs(0x01, PWM_MAX, tapFrames[tapCount], maxDuty);
 				
 				// exit tap temp entry if it has been more than 
 				// 1 second since the last valid tap
-				if(systemTicks - lastTapSystemTicks > 1000)
-				{
-					lastTapSystemTicks = 0;
-					firstTapSystemTicks = 0;
+				if(!timerRunning(TIMER_TAP))
 					tapCount = 0;
-				}
 			}			
-			else if(running)
-			{
-				if(_options & OPTION_DISCREET)
-				{
-					duty[0] = maxDuty;
-					duty[1] = 0;
-					duty[2] = 0;
-					duty[3] = 0;
-					duty[4] = 0;
-					duty[5] = (tickCount == 1)? maxDuty : 0;
-				}
-				else
-				{				
-					// Cycling "running" animation
-					byte whichLED = tickCount/4;				
-					duty[0] = (whichLED == 0)? maxDuty : 0;
-					duty[1] = (whichLED == 1)? maxDuty : 0;
-					duty[2] = (whichLED == 2)? maxDuty : 0;
-					duty[3] = (whichLED == 3)? maxDuty : 0;
-					duty[4] = (whichLED == 4)? maxDuty : 0;
-					duty[5] = (whichLED == 5)? maxDuty : 0;
-				}
-			}
 			else 
+#endif
 			{
+				// running or paused animation, one frame for 
+				// each tick of the beat
+				byte frames = running ? FRAMES_RUNNING : FRAMES_PAUSED;
 				if(_options & OPTION_DISCREET)
-				{
-					duty[0] = 0;
-					duty[1] = 0;
-					duty[2] = 0;
-					duty[3] = 0;
-					duty[4] = 0;
-					duty[5] = tickCount? 0 : maxDuty;
-				}
-				else
-				{
-					// Flashing "paused" indicator (leds 0,1,4,5)
-					duty[0] = tickCount? 0 : maxDuty;
-					duty[1] = tickCount? 0 : maxDuty;
-					duty[2] = 0;
-					duty[3] = 0;
-					duty[4] = tickCount? 0 : maxDuty;
-					duty[5] = tickCount? 0 : maxDuty;				
-				}
+					frames += FRAMES_DISCREET_RUNNING;
+				setLEDs(clockFrames[frames * FRAMES_PER_BEAT + tickCount], maxDuty, 0, 0);
 			}			
 		}	
-
-		// PWM the LEDs
-		P_LED0 = (duty[0]>pwm);
-		P_LED1 = (duty[1]>pwm);
-		P_LED2 = (duty[2]>pwm);
-		P_LED3 = (duty[3]>pwm);
-		P_LED4 = (duty[4]>pwm);
-		P_LED5 = (duty[5]>pwm);
-		if(++pwm > PWM_MAX) 
-			pwm=0;
+#endif
 
 		// HANDLE USER INPUT
-		if(systemTicks >= debouncePeriodEnd) // check not debouncing
+		// The buttons are only read when the ISR has seen one 
+		// change, or when one is held and the auto repeat is due.
+		// (the core is not put to sleep when idle since sleep
+		// stops the EUSART and the timers the clock depends on)
+		if(!timerRunning(TIMER_DEBOUNCE) && // check not debouncing
+			(buttonChange || (lastButtonStatus && !timerRunning(TIMER_REPEAT))))
 		{
+			buttonChange = 0;
+
 			// gather up the button statuses into a single byte
 			byte thisButtonStatus = 
 				(!P_RUN ? M_BUTTON_RUN : 0) |
 				(!P_DEC ? M_BUTTON_DEC : 0) |
 				(!P_INC ? M_BUTTON_INC : 0);
+#if FEATURE_TAP
+			// DEC is up, so the ISR can time the next press
+			if(!(thisButtonStatus & M_BUTTON_DEC))
+				tapStampState = TAP_STAMP_ARMED;
+#endif
 								
 			// see if anything has changed since last poll
 			byte buttonActivity = thisButtonStatus ^ lastButtonStatus;			
@@ -600,20 +3399,19 @@ void main()
 			if(!buttonActivity)
 			{				
 				// do we need to autorepeat?
-				if(thisButtonStatus && systemTicks > autoRepeatBegin)
+				if(thisButtonStatus && !timerRunning(TIMER_REPEAT))
 				{
-					if(!nextAutoRepeat)
+					if(!longPress)
 					{
 						thisButtonStatus = thisButtonStatus|M_LONG_PRESS;
-						buttonsPressed = thisButtonStatus;
-						nextAutoRepeat = systemTicks + AUTO_REPEAT_INTERVAL;
+						longPress = 1;
 					}
-					else if(systemTicks > nextAutoRepeat)
+					else
 					{
 						thisButtonStatus = thisButtonStatus|M_AUTO_REPEAT;
-						buttonsPressed = thisButtonStatus;
-						nextAutoRepeat = systemTicks + AUTO_REPEAT_INTERVAL;
 					}
+					buttonsPressed = thisButtonStatus;
+					startTimer(TIMER_REPEAT, AUTO_REPEAT_INTERVAL);
 				}
 			}
 			else
@@ -623,10 +3421,33 @@ void main()
 				if(buttonsPressed)
 				{
 					// prepare debounce and auto repeat
-					autoRepeatBegin = systemTicks + AUTO_REPEAT_DELAY;
-					nextAutoRepeat = 0;
+					startTimer(TIMER_REPEAT, AUTO_REPEAT_DELAY);
+					longPress = 0;
+				}
+				startTimer(TIMER_DEBOUNCE, DEBOUNCE_PERIOD);
+			}
+			
+			// INC AND DEC PRESSED TOGETHER (DEFAULT BPM)
+			// Holding them is a panic instead, so a short press is 
+			// only acted on when one of them is let go
+			if(incDecPending && buttonActivity)
+			{
+				incDecPending = 0;
+				if(!buttonsPressed)
+				{
+#if FEATURE_CLOCK
+					if(MODE_STEP == _mode && !slaveFollow)
+						setBPM(BPM_DEFAULT);
+#endif
+#if FEATURE_MENU
+					if(MODE_MENU == _mode)
+					{
+						// Enters error counter display
+						statsIndex = 0;
+						_mode = MODE_STATS;
+					}
+#endif
 				}
-				debouncePeriodEnd = systemTicks + DEBOUNCE_PERIOD;
 			}
 			
 			// any new button presses or auto repeats?
@@ -635,74 +3456,133 @@ void main()
 				// execute the command
 				switch(thisButtonStatus)
 				{
+#if FEATURE_MENU
 					////////////////////////////////////////////////////////////
 					// ALL BUTTONS PRESSED TOGETHER (MENU MODE)
 					case M_BUTTON_RUN|M_BUTTON_DEC|M_BUTTON_INC:
 						menuOption = 0;
 						_mode = MODE_MENU;
 						break;
+#endif
 						
+#if FEATURE_TAP
 					////////////////////////////////////////////////////////////
 					// DEC AND RUN PRESSED TOGETHER (TAP TEMPO MODE)
 					case M_BUTTON_RUN|M_BUTTON_DEC:
 						_mode = MODE_TAP;
 						break;
+#endif
 						
+#if FEATURE_CLOCK
 					////////////////////////////////////////////////////////////
 					// INC AND RUN PRESSED TOGETHER (SPLIT ONLY MODE)
 					case M_BUTTON_RUN|M_BUTTON_INC:
 						_mode = MODE_NOCLOCK;
 						break;
+#endif
 
 					////////////////////////////////////////////////////////////
-					// INC AND DEC PRESSED TOGETHER (DEFAULT BPM)
+					// INC AND DEC PRESSED TOGETHER (DEFAULT BPM, ON RELEASE)
 					case M_BUTTON_INC|M_BUTTON_DEC:
-						if(MODE_STEP == _mode)
-							setBPM(BPM_DEFAULT);
+						incDecPending = 1;
+						break;
+						
+					////////////////////////////////////////////////////////////
+					// INC AND DEC HELD TOGETHER (PANIC)
+					case M_LONG_PRESS|M_BUTTON_INC|M_BUTTON_DEC:
+						incDecPending = 0;
+						panicPending = 1;
 						break;
 						
 					////////////////////////////////////////////////////////////
 					// RUN PRESSED
 					case M_BUTTON_RUN:				
+#if FEATURE_CLOCK
 						if(MODE_TAP == _mode || MODE_STEP == _mode)
 						{
 							if(runLock)
 							{
 								midiRestart = 1;
 							}
+							else if(runRequest)
+							{
+								// pressed again before the start of 
+								// the bar, so forget about it
+								runRequest = RUN_REQUEST_NONE;
+							}
 							else
 							{
-								// When clock is enabled we toggle run/paused
-								running = !running;
-								if(_options & OPTION_STARTSTOP)
+								// When clock is enabled we toggle run/paused.
+								// START is queued before the ISR is allowed to
+								// send any more clock ticks. With a bar length
+								// the ISR does it at the start of the bar, and
+								// the song position is kept when stopping so 
+								// the next start carries on from there
+								intcon.7 = 0;
+								unsigned int pos = songPosition;
+								intcon.7 = 1;
+								if(running)
 								{
-									if(running)
+									if(_barLength > 1)
 									{
-										tickCount = 0;
-										send(MIDI_SYNCH_START);
+										runRequest = RUN_REQUEST_STOP;
 									}
 									else
 									{
-										send(MIDI_SYNCH_STOP);			
+										running = 0;
+										if(_options & OPTION_STARTSTOP)
+											sendRealtime(MIDI_SYNCH_STOP);			
+										panicPending = 1;
+										setSongPosition(0);
+									}
+								}
+								else if(_barLength > 1 || pos)
+								{
+									// downstream gets our song position 
+									// ahead of the CONTINUE
+									if(pos && (_options & OPTION_STARTSTOP) && !(_options & OPTION_HARDTHRU))
+										sppPending = 1;
+									runRequest = RUN_REQUEST_START;
+								}
+								else
+								{
+									if(_options & OPTION_STARTSTOP)
+									{
+										intcon.7 = 0;
+										RESET_CLOCK_PHASE(0, 0);
+										intcon.7 = 1;
+										sendRealtime(MIDI_SYNCH_START);
 									}
+									positionTicks = 0;
+									running = 1;
 								}
 							}
 						}						
 						else
+#endif
 						if(MODE_NOCLOCK == _mode) // SPLIT MODE
 						{
-							send(MIDI_SYNCH_START);
+							sendRealtime(MIDI_SYNCH_START);
 							running = 1;
 						}
+#if FEATURE_MENU
 						else 
 						if(MODE_MENU == _mode)
 						{
 							// Exits from menu mode
-							_mode = MODE_STEP;
+							_mode = MODE_HOME;
 							running = 0;
 						}
+						else 
+						if(MODE_STATS == _mode)
+						{
+							// Back to the menu
+							_mode = MODE_MENU;
+						}
+#endif
 						break;
 
+#if FEATURE_CLOCK
 					case M_BUTTON_RUN|M_LONG_PRESS:										
 						if(!runLock)
 						{
@@ -714,91 +3594,139 @@ void main()
 							runLock = 0;
 						}
 						break;
+#endif
 						
 					////////////////////////////////////////////////////////////
 					// DEC PRESSED
 					case M_BUTTON_DEC:
+#if FEATURE_MENU
 						if(MODE_MENU == _mode)
 						{							
-							if(5 == menuOption)
+							if(MENU_ITEM_BRIGHTNESS == menuOption)
 							{
 								_brightness = (_brightness + 1) % NUM_BRIGHTNESS_LEVELS;
 								maxDuty = brightnessLevels[_brightness];
 							}
+							else if(MENU_ITEM_CLOCK_RATIO == menuOption)
+							{
+								setClockRatio((_clockRatio + 1) % NUM_CLOCK_RATIOS);
+							}
+							else if(MENU_ITEM_SWING == menuOption)
+							{
+								_swing = (_swing + 1) % NUM_SWING_LEVELS;
+								setBPM(_bpm);
+							}
+							else if(MENU_ITEM_BAR_LENGTH == menuOption)
+							{
+								_barLength = (_barLength % NUM_BAR_LENGTHS) + 1;
+							}
+							else if(MENU_ITEM_CLOCK_OFFSET == menuOption)
+							{
+								setClockOffset((_clockOffset >= CLOCK_OFFSET_MAX) ? CLOCK_OFFSET_MIN : _clockOffset + 1);
+							}
 							else
 							{
 								// In menu mode, toggles options on/off
-								_options ^= (1<<menuOption);
+								menuItemToggle(menuOption);
 							}							
 							saveOptions();
 							break;
 						}
-						else 
+						if(MODE_STATS == _mode)
+						{
+							// Clears the selected counter
+							clearStat(statsIndex);
+							break;
+						}
+#endif
+#if FEATURE_CLOCK
 						if(MODE_NOCLOCK == _mode)
 						{
 							// Exits split-only mode
 							_mode = MODE_STEP;
 							break;
 						}
-						else 
+#endif
+#if FEATURE_TAP
 						if(MODE_TAP == _mode)
 						{						
-							// In tap mode, counts a "tap"
+							// In tap mode, counts a "tap". The tempo
+							// keeps tracking for as long as we tap
+							unsigned long tapTime = getTapTime();
 							if(!tapCount)
 							{
 								tapCount = 1;
-								firstTapSystemTicks = systemTicks;
+								tapHistoryCount = 0;
+								tapOutlier = 0;
+								tapMerged = 0;
 							}
 							else
-							if(tapCount < 6 && systemTicks > firstTapSystemTicks)//rollover check
 							{
-								unsigned long period = systemTicks - firstTapSystemTicks;
-								period = period / tapCount;
-								setBPM(60000UL / period);
-								tapCount++;
+								// 600 x (4us counts per second) / interval
+								setBPM(150000000UL / tapAddInterval(tapTime - lastTapTime));
+								if(tapCount < 6)
+									tapCount++;
 							}
-							lastTapSystemTicks = systemTicks;
+							lastTapTime = tapTime;
+							startTimer(TIMER_TAP, TAP_TIMEOUT);
 							break;
-						}//fallthru
+						}
+#endif
+						//fallthru
+#if FEATURE_CLOCK
 					case M_LONG_PRESS|M_BUTTON_DEC:
 					case M_AUTO_REPEAT|M_BUTTON_DEC:
-						if(MODE_STEP == _mode)
-							setBPM(_bpm-1);												
+						if(MODE_STEP == _mode && !slaveFollow)
+							setBPM(_bpm - ((_options & OPTION_FINETEMPO) ? BPM_FINE_STEP : BPM_STEP));
+#endif
 						break;
 						
 					////////////////////////////////////////////////////////////
 					// INC PRESSED
 					case M_BUTTON_INC:
+#if FEATURE_MENU
 						if(MODE_MENU == _mode)
 						{
 							// menu mode - select menu option
 							menuOption = (menuOption+1) % MENU_SIZE;
 							break;
 						}
-						else 
+						if(MODE_STATS == _mode)
+						{
+							// select the next counter
+							statsIndex = (statsIndex+1) % NUM_STATS;
+							break;
+						}
+#endif
 						if(MODE_NOCLOCK == _mode) // SPLIT MODE
 						{
 							if(running)
 							{
-								send(MIDI_SYNCH_STOP);
+								sendRealtime(MIDI_SYNCH_STOP);
 								running = 0;
+								panicPending = 1;
 							}
 							else
 							{
-								send(MIDI_SYNCH_CONTINUE);
+								sendRealtime(MIDI_SYNCH_CONTINUE);
 								running = 1;
 							}						
 						}
+#if FEATURE_TAP
 						if(MODE_TAP == _mode)
 						{
 							// tap mode - exits tap mode
 							_mode = MODE_STEP;
 							break;
-						}//fallthru
+						}
+#endif
+						//fallthru
+#if FEATURE_CLOCK
 					case M_LONG_PRESS|M_BUTTON_INC:
 					case M_AUTO_REPEAT|M_BUTTON_INC:
-						if(MODE_STEP == _mode)
-							setBPM(_bpm+1);												
+						if(MODE_STEP == _mode && !slaveFollow)
+							setBPM(_bpm + ((_options & OPTION_FINETEMPO) ? BPM_FINE_STEP : BPM_STEP));
+#endif
 						break;
 				
 				}				
@@ -0,0 +1,15 @@
+// Host build of MidiHub.c
+// Stands in for the SourceBoost eeprom.h. Writes go through the
+// EECON registers, which sim.c completes after the write time
+
+#ifndef SIM_EEPROM_H
+#define SIM_EEPROM_H
+
+unsigned char simEeprom[256];
+
+unsigned char eeprom_read(unsigned char addr)
+{
+	return simEeprom[addr];
+}
+
+#endif
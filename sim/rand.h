@@ -0,0 +1,3 @@
+// Host build of MidiHub.c
+// Stands in for the SourceBoost rand.h, which the firmware
+// includes but does not use
@@ -0,0 +1,907 @@
+////////////////////////////////////////////////////////////
+//
+// MIDI HUB HOST SIMULATOR AND TRACE REPLAY BENCHMARK
+//
+// MidiHub.c is built for the host (see host.sed and system.h)
+// and runs from main() as it would on the PIC. This file plays
+// the part of the PIC16F1825 peripherals the firmware uses, one
+// instruction cycle (4MHz) at a time:
+//
+//	- timer 0, 1, 2 and 4 with their prescalers, CCP1 special
+//	  event trigger and CCP2 compare
+//	- the EUSART, with its two byte receive FIFO, overrun and
+//	  the transmit register/shift register pair
+//	- the RA3 second input line, driven bit by bit for the
+//	  firmware's software UART, and RA4/RA5/RC3 buttons with
+//	  interrupt on change
+//	- data EEPROM writes, which take 4ms
+//
+// Interrupts are delivered whenever GIE is set and a source is
+// pending. The main loop only lets simulated time pass when it
+// sets GIE, and the ISR is charged cycles for each source it
+// serves (isrCost[]). These costs are a model (see -q, -l and
+// -i), not a count of the PIC code. For real per-path cycle
+// figures use the INSTRUMENT firmware build on the hardware.
+//
+// A trace gives timestamped input (see traces/). The report at
+// the end gives dropped bytes, thru latency, clock jitter and
+// how busy the ISR was.
+//
+////////////////////////////////////////////////////////////
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <setjmp.h>
+#include <math.h>
+
+// the firmware, with int made 16 bits as it is for BoostC
+#define int short
+#include "midihub_host.c"
+#undef int
+
+#define CYCLES_PER_US		4
+#define CYCLES_PER_MS		4000
+#define MIDI_BIT_CYCLES		128		// 31250 baud
+#define MIDI_BYTE_CYCLES	1280	// start, 8 data and stop bits
+#define RCIF_CYCLES			1216	// EUSART has the byte mid stop bit
+#define EEPROM_WRITE_CYCLES	16000	// 4ms
+#define LATENCY_WINDOW		(100 * CYCLES_PER_MS)
+#define HIST_BINS			8		// <64us, <128us ... >=4096us
+
+////////////////////////////////////////////////////////////
+// TRACE
+enum {
+	EV_IN1,		// byte at the EUSART input
+	EV_IN2,		// byte at the RA3 software UART input
+	EV_BUTTON	// button goes down or up
+};
+typedef struct {
+	unsigned long long cycle;	// when the event starts
+	unsigned long seq;			// order in the file, for a stable sort
+	unsigned char type;
+	unsigned char value;		// byte, or button mask
+	unsigned char down;
+} EVENT;
+
+static EVENT *events = NULL;
+static unsigned long numEvents = 0;
+static unsigned long eventsSize = 0;
+static unsigned long long traceEnd = 0;
+
+// bytes at each input, in the order they go on the wire
+typedef struct {
+	unsigned long long start;	// start bit
+	unsigned char b;
+	unsigned char matched;
+} FRAME;
+static FRAME *in1 = NULL, *in2 = NULL;
+static unsigned long numIn1 = 0, numIn2 = 0;
+
+// bytes sent by the firmware
+typedef struct {
+	unsigned long long start;
+	unsigned char b;
+} OUTBYTE;
+static OUTBYTE *out = NULL;
+static unsigned long numOut = 0, outSize = 0;
+
+////////////////////////////////////////////////////////////
+// SIMULATOR STATE
+static unsigned long long simCycle = 0;
+static unsigned long long simEndCycle = 0;
+static jmp_buf simDone;
+static int simInIsr = 0;
+static int simBooted = 0;
+static unsigned simMainQuantum = 40;	// cycles per GIE set in the main loop
+static unsigned simIsrLatency = 24;		// cycles from the interrupt to the ISR body
+static unsigned simIsrScale = 100;		// percent applied to isrCost[]
+
+// EUSART
+static unsigned char rxFifo[2];
+static int rxCount = 0;
+static unsigned long rxReads = 0, txWrites = 0;
+static unsigned long in1Pos = 0;
+static int txregFull = 0;
+static unsigned char txregByte = 0;
+static unsigned long long tsrEnd = 0;
+
+// RA3 line and buttons (RUN RC3, DEC RA4, INC RA5)
+static unsigned long in2Pos = 0;
+static unsigned char buttons = 0;		// M_BUTTON_ bits held down
+static unsigned char pinsA = 0x38;		// port A inputs, for interrupt on change
+static unsigned long eventPos = 0;
+
+// EEPROM
+static int eeBusy = 0;
+static unsigned long long eeDone = 0;
+
+// statistics
+static unsigned long statRxOverrun = 0;
+static unsigned long statTxOverwrite = 0;
+static unsigned long statGieInIsr = 0;
+static unsigned long statEepromWrites = 0;
+static unsigned long statSampleLate = 0;
+static unsigned long statSampleMissed = 0;
+static unsigned long statIsrPasses = 0;
+static unsigned long long statIsrCycles = 0;
+enum { SRC_TMR0, SRC_IOC, SRC_TMR2, SRC_CCP1, SRC_CCP2, SRC_TMR4, SRC_RX, SRC_TX, NUM_SRC };
+static const char *srcNames[NUM_SRC] = { "timer0", "ioc", "timer2", "ccp1", "ccp2", "timer4", "rx", "tx" };
+static unsigned long statSrc[NUM_SRC];
+
+// Modelled cycles the ISR body spends on each source it finds
+// pending, on top of the entry latency. The clock tick includes
+// sending the F8 and the LED update, and the receive includes
+// the realtime and buffer handling
+static const unsigned isrCost[NUM_SRC] = {
+	30,		// timer0: systemTicks, RUN pin, slave timeout
+	20,		// ioc: start bit or buttons
+	40,		// timer2: one LED plane
+	160,	// ccp1: the next tick period and isrClockTick()
+	40,		// ccp2: a multiplied tick
+	24,		// timer4: one software UART sample
+	60,		// rx: a byte from the EUSART
+	40		// tx: the next byte from the buffers
+};
+static unsigned long statIsrSrc[NUM_SRC];
+
+// options applied when the firmware first enables interrupts
+static int optOptions = -1, optOptions2 = -1, optBPM = -1, optMode = -1, optRatio = -1;
+static const char *optDump = NULL;
+
+////////////////////////////////////////////////////////////
+// EUSART DATA REGISTERS
+unsigned char simRx(void)
+{
+	unsigned char b = rxFifo[0];
+	if(rxCount)
+	{
+		rxFifo[0] = rxFifo[1];
+		--rxCount;
+	}
+	SIM_BIT(pir1, 5) = (rxCount > 0);
+	++rxReads;
+	return b;
+}
+
+static void simTxLoad(void)
+{
+	// TXREG moves to the shift register as soon as it is free
+	if(txregFull && simCycle >= tsrEnd)
+	{
+		if(numOut == outSize)
+		{
+			outSize = outSize ? outSize * 2 : 4096;
+			out = realloc(out, outSize * sizeof(OUTBYTE));
+		}
+		out[numOut].start = simCycle;
+		out[numOut].b = txregByte;
+		++numOut;
+		tsrEnd = simCycle + MIDI_BYTE_CYCLES;
+		txregFull = 0;
+		SIM_BIT(pir1, 4) = 1;
+	}
+	SIM_BIT(txsta, 1) = (simCycle >= tsrEnd); // TRMT
+}
+
+// clearing CREN clears an overrun
+void simResetReceiver(void)
+{
+	SIM_BIT(rcsta, 4) = 0;
+	SIM_BIT(rcsta, 1) = 0;
+}
+
+void simTx(unsigned char b)
+{
+	++txWrites;
+	if(txregFull)
+		++statTxOverwrite;
+	txregFull = 1;
+	txregByte = b;
+	SIM_BIT(pir1, 4) = 0;
+	simTxLoad();
+}
+
+////////////////////////////////////////////////////////////
+// TIMER 0 WRITES
+// Writing TMR0 clears the prescaler and holds off the next two
+// counts
+static unsigned t0Prescale = 0;
+static unsigned t0Inhibit = 0;
+
+void simWriteTmr0(unsigned char v)
+{
+	tmr0 = v;
+	t0Prescale = 0;
+	t0Inhibit = 2;
+}
+
+////////////////////////////////////////////////////////////
+// ONE INSTRUCTION CYCLE OF THE PERIPHERALS
+static unsigned prescale(unsigned char con)
+{
+	static const unsigned p[4] = { 1, 4, 16, 64 };
+	return p[con & 0x03];
+}
+
+// interrupt flags, one bit for each source
+static unsigned flagBits(void)
+{
+	return
+		(SIM_BIT(intcon, 2) << SRC_TMR0) |
+		((iocaf ? 1 : 0) << SRC_IOC) |
+		(SIM_BIT(pir1, 1) << SRC_TMR2) |
+		(SIM_BIT(pir1, 2) << SRC_CCP1) |
+		(SIM_BIT(pir2, 0) << SRC_CCP2) |
+		(SIM_BIT(pir3, 1) << SRC_TMR4) |
+		(SIM_BIT(pir1, 5) << SRC_RX) |
+		(SIM_BIT(pir1, 4) << SRC_TX);
+}
+
+// the flags that would interrupt
+static unsigned enabledBits(void)
+{
+	unsigned m = 0;
+	if(SIM_BIT(intcon, 5)) m |= 1 << SRC_TMR0;
+	if(SIM_BIT(intcon, 3)) m |= 1 << SRC_IOC;
+	if(SIM_BIT(intcon, 6))
+	{
+		if(SIM_BIT(pie1, 1)) m |= 1 << SRC_TMR2;
+		if(SIM_BIT(pie1, 2)) m |= 1 << SRC_CCP1;
+		if(SIM_BIT(pie2, 0)) m |= 1 << SRC_CCP2;
+		if(SIM_BIT(pie3, 1)) m |= 1 << SRC_TMR4;
+		if(SIM_BIT(pie1, 5)) m |= 1 << SRC_RX;
+		if(SIM_BIT(pie1, 4)) m |= 1 << SRC_TX;
+	}
+	return m;
+}
+
+// counts each interrupt flag as it is raised
+static void countSources(void)
+{
+	static unsigned last = 0;
+	unsigned now = flagBits();
+	unsigned rise = now & ~last;
+	for(int i=0; i<NUM_SRC; ++i)
+		if(rise & (1 << i))
+			++statSrc[i];
+
+	// how late the software UART samples the line
+	static unsigned long long sampleDue = 0;
+	if(rise & (1 << SRC_TMR4))
+		sampleDue = simCycle;
+	else if(last & ~now & (1 << SRC_TMR4))
+	{
+		unsigned long late = simCycle - sampleDue;
+		if(late > statSampleLate)
+			statSampleLate = late;
+		if(late >= MIDI_BIT_CYCLES / 2)
+			++statSampleMissed;
+	}
+	last = now;
+}
+
+static void simStep(void)
+{
+	++simCycle;
+
+	// timer 0, 1:16 prescale
+	if(t0Inhibit)
+		--t0Inhibit;
+	else if(++t0Prescale >= 16)
+	{
+		t0Prescale = 0;
+		if(++tmr0 == 0)
+			SIM_BIT(intcon, 2) = 1;
+	}
+
+	// timer 1, 1:8 prescale. The CCP1 special event trigger
+	// resets it on the count after a match, even if CCPR1 has
+	// been changed since
+	if(SIM_BIT(t1con, 0) && !(simCycle & 7))
+	{
+		static int t1Reset = 0;
+		unsigned t = (tmr1h << 8) | tmr1l;
+		if(t1Reset)
+			t = 0;
+		else
+			t = (t + 1) & 0xFFFF;
+		tmr1h = t >> 8;
+		tmr1l = t & 0xFF;
+		t1Reset = ((ccp1con & 0x0F) == 0x0B && t == (unsigned)((ccpr1h << 8) | ccpr1l));
+		if(t1Reset)
+			SIM_BIT(pir1, 2) = 1;
+		if((ccp2con & 0x0F) == 0x0A && t == (unsigned)((ccpr2h << 8) | ccpr2l))
+			SIM_BIT(pir2, 0) = 1;
+	}
+
+	// timers 2 and 4 count up to their period register
+	if(SIM_BIT(t2con, 2) && !(simCycle % prescale(t2con)))
+	{
+		if(tmr2 == pr2)
+		{
+			tmr2 = 0;
+			SIM_BIT(pir1, 1) = 1;
+		}
+		else
+			++tmr2;
+	}
+	if(SIM_BIT(t4con, 2) && !(simCycle % prescale(t4con)))
+	{
+		if(tmr4 == pr4)
+		{
+			tmr4 = 0;
+			SIM_BIT(pir3, 1) = 1;
+		}
+		else
+			++tmr4;
+	}
+
+	// EUSART receive
+	while(in1Pos < numIn1 && in1[in1Pos].start + RCIF_CYCLES <= simCycle)
+	{
+		if(rxCount < 2 && !SIM_BIT(rcsta, 1))
+		{
+			rxFifo[rxCount++] = in1[in1Pos].b;
+			SIM_BIT(pir1, 5) = 1;
+		}
+		else
+		{
+			SIM_BIT(rcsta, 1) = 1; // OERR
+			++statRxOverrun;
+		}
+		++in1Pos;
+	}
+	simTxLoad();
+
+	// RA3 line, one frame after another
+	int level = 1;
+	while(in2Pos < numIn2 && simCycle >= in2[in2Pos].start + MIDI_BYTE_CYCLES)
+		++in2Pos;
+	if(in2Pos < numIn2 && simCycle >= in2[in2Pos].start)
+	{
+		unsigned bit = (simCycle - in2[in2Pos].start) / MIDI_BIT_CYCLES;
+		if(!bit)
+			level = 0;
+		else if(bit <= 8)
+			level = (in2[in2Pos].b >> (bit - 1)) & 1;
+	}
+
+	// buttons
+	while(eventPos < numEvents && events[eventPos].cycle <= simCycle)
+	{
+		if(EV_BUTTON == events[eventPos].type)
+		{
+			if(events[eventPos].down)
+				buttons |= events[eventPos].value;
+			else
+				buttons &= ~events[eventPos].value;
+		}
+		++eventPos;
+	}
+
+	// input pins, with interrupt on change for port A
+	unsigned char a = porta & ~0x38;
+	if(level)
+		a |= 0x08;
+	if(!(buttons & M_BUTTON_DEC))
+		a |= 0x10;
+	if(!(buttons & M_BUTTON_INC))
+		a |= 0x20;
+	unsigned char rise = a & ~pinsA & 0x38;
+	unsigned char fall = ~a & pinsA & 0x38;
+	iocaf |= (rise & iocap) | (fall & iocan);
+	pinsA = a;
+	porta = a;
+	SIM_BIT(portc, 3) = !(buttons & M_BUTTON_RUN);
+
+	// EEPROM write
+	if(SIM_BIT(eecon1, 1))
+	{
+		if(!eeBusy)
+		{
+			eeBusy = 1;
+			eeDone = simCycle + EEPROM_WRITE_CYCLES;
+		}
+		else if(simCycle >= eeDone)
+		{
+			simEeprom[eeadrl] = eedatl;
+			SIM_BIT(eecon1, 1) = 0;
+			eeBusy = 0;
+			++statEepromWrites;
+		}
+	}
+	countSources();
+}
+
+////////////////////////////////////////////////////////////
+// INTERRUPTS
+static int simIrqPending(void)
+{
+	return SIM_BIT(intcon, 7) && (flagBits() & enabledBits());
+}
+
+static void simAdvance(unsigned cycles);
+
+// The ISR is charged for each source it has dealt with, as it
+// goes. host.sed puts simIsrPoint() before each isrSoftUart()
+// call, so time passes between the parts of interrupt() and the
+// software UART sees the line as it would on the PIC. A source
+// has been dealt with once its flag is clear (or, for the
+// EUSART, a byte has been read or written)
+static unsigned isrSeen = 0;
+static unsigned long isrReads = 0, isrWrites = 0;
+
+static void isrCharge(int last)
+{
+	unsigned flags = flagBits();
+	unsigned done = isrSeen & ~flags;
+	if(rxReads != isrReads)
+		done |= isrSeen & (1 << SRC_RX);
+	if(txWrites != isrWrites)
+		done |= isrSeen & (1 << SRC_TX);
+	if(last)
+		done = isrSeen;
+	isrSeen &= ~done;
+	isrReads = rxReads;
+	isrWrites = txWrites;
+
+	unsigned cost = 0;
+	for(int i=0; i<NUM_SRC; ++i)
+	{
+		if(done & (1 << i))
+		{
+			cost += isrCost[i];
+			++statIsrSrc[i];
+		}
+	}
+	cost = cost * simIsrScale / 100;
+	statIsrCycles += cost;
+	simAdvance(cost);
+	if(!last)
+		isrSeen |= flagBits() & enabledBits();
+}
+
+void simIsrPoint(void)
+{
+	if(simInIsr)
+		isrCharge(0);
+}
+
+static void simRunIsr(void)
+{
+	// the ISR body starts after the entry latency (the vector
+	// and the context save)
+	SIM_BIT(intcon, 7) = 0;
+	simInIsr = 1;
+	simAdvance(simIsrLatency);
+	statIsrCycles += simIsrLatency;
+	++statIsrPasses;
+	isrSeen = flagBits() & enabledBits();
+	isrReads = rxReads;
+	isrWrites = txWrites;
+	interrupt();
+	isrCharge(1);
+	simInIsr = 0;
+	SIM_BIT(intcon, 7) = 1;
+}
+
+static void simAdvance(unsigned cycles)
+{
+	while(cycles--)
+	{
+		simStep();
+		if(!simInIsr)
+		{
+			while(simIrqPending())
+				simRunIsr();
+		}
+	}
+}
+
+static void simApplyOptions(void)
+{
+	if(optOptions >= 0)
+		_options = optOptions;
+	if(optOptions2 >= 0)
+		_options2 = optOptions2;
+	if(optBPM >= 0)
+		settingsBPM = optBPM;
+	if(optMode >= 0)
+		_mode = optMode;
+	if(optRatio >= 0)
+		setClockRatio(optRatio);
+}
+
+void simEnableInterrupts(void)
+{
+	if(simInIsr)
+	{
+		++statGieInIsr;
+		return;
+	}
+	SIM_BIT(intcon, 7) = 1;
+
+	// SIM_BIT(intcon, 7) = 1 at the end of the boot code is the
+	// first time interrupts are enabled
+	if(!simBooted)
+	{
+		simBooted = 1;
+		simApplyOptions();
+	}
+	simAdvance(simMainQuantum);
+	if(simCycle >= simEndCycle)
+		longjmp(simDone, 1);
+}
+
+////////////////////////////////////////////////////////////
+// LOAD A TRACE
+// Each line is a time in ms followed by one of
+//	in1 <hex bytes>			bytes at the main input
+//	in2 <hex bytes>			bytes at the second input
+//	repeat <n> <ms> in1|in2 <hex bytes>
+//							the bytes n times, ms apart
+//	button run|inc|dec down|up
+//	end						stop the simulation here
+// Bytes given together go out back to back, and bytes at one
+// input wait for the one before to finish
+static void addEvent(unsigned long long cycle, unsigned char type, unsigned char value, unsigned char down)
+{
+	if(numEvents == eventsSize)
+	{
+		eventsSize = eventsSize ? eventsSize * 2 : 4096;
+		events = realloc(events, eventsSize * sizeof(EVENT));
+	}
+	events[numEvents].cycle = cycle;
+	events[numEvents].seq = numEvents;
+	events[numEvents].type = type;
+	events[numEvents].value = value;
+	events[numEvents].down = down;
+	++numEvents;
+}
+
+static int compareEvents(const void *a, const void *b)
+{
+	const EVENT *x = a, *y = b;
+	if(x->cycle != y->cycle)
+		return x->cycle < y->cycle ? -1 : 1;
+	return x->seq < y->seq ? -1 : 1;
+}
+
+static int parseBytes(char *s, unsigned char *bytes)
+{
+	int n = 0;
+	char *tok;
+	while(n < 256 && (tok = strtok(s, " \t\r\n")) != NULL)
+	{
+		s = NULL;
+		if('#' == *tok)
+			break;
+		bytes[n++] = (unsigned char)strtoul(tok, NULL, 16);
+	}
+	return n;
+}
+
+static void loadTrace(const char *path)
+{
+	FILE *f = fopen(path, "r");
+	if(!f)
+	{
+		perror(path);
+		exit(2);
+	}
+	char line[1024];
+	int lineNo = 0;
+	int ended = 0;
+	while(fgets(line, sizeof(line), f))
+	{
+		++lineNo;
+		char *p = line;
+		while(*p == ' ' || *p == '\t')
+			++p;
+		if(!*p || '#' == *p || '\n' == *p || '\r' == *p)
+			continue;
+		char *rest;
+		double ms = strtod(p, &rest);
+		unsigned long long cycle = (unsigned long long)(ms * CYCLES_PER_MS + 0.5);
+		char what[16];
+		int used = 0;
+		if(sscanf(rest, "%15s%n", what, &used) != 1)
+			goto bad;
+		rest += used;
+
+		unsigned long count = 1;
+		double interval = 0;
+		if(!strcmp(what, "repeat"))
+		{
+			if(sscanf(rest, "%lu %lf %15s%n", &count, &interval, what, &used) != 3)
+				goto bad;
+			rest += used;
+		}
+		if(!strcmp(what, "in1") || !strcmp(what, "in2"))
+		{
+			unsigned char bytes[256];
+			int n = parseBytes(rest, bytes);
+			unsigned char type = strcmp(what, "in1") ? EV_IN2 : EV_IN1;
+			for(unsigned long i=0; i<count; ++i)
+			{
+				unsigned long long c = cycle + (unsigned long long)(i * interval * CYCLES_PER_MS + 0.5);
+				for(int j=0; j<n; ++j)
+					addEvent(c + (unsigned long long)j * MIDI_BYTE_CYCLES, type, bytes[j], 0);
+				if(c > traceEnd && !ended)
+					traceEnd = c;
+			}
+		}
+		else if(!strcmp(what, "button"))
+		{
+			char name[16], state[16];
+			if(sscanf(rest, "%15s %15s", name, state) != 2)
+				goto bad;
+			unsigned char mask;
+			if(!strcmp(name, "run")) mask = M_BUTTON_RUN;
+			else if(!strcmp(name, "inc")) mask = M_BUTTON_INC;
+			else if(!strcmp(name, "dec")) mask = M_BUTTON_DEC;
+			else goto bad;
+			addEvent(cycle, EV_BUTTON, mask, !strcmp(state, "down"));
+			if(cycle > traceEnd && !ended)
+				traceEnd = cycle;
+		}
+		else if(!strcmp(what, "end"))
+		{
+			traceEnd = cycle;
+			ended = 1;
+		}
+		else
+			goto bad;
+		continue;
+bad:
+		fprintf(stderr, "%s:%d: can't read this line\n", path, lineNo);
+		exit(2);
+	}
+	fclose(f);
+	if(!ended)
+		traceEnd += 500 * CYCLES_PER_MS;
+
+	// sort, then queue the bytes at each input one after another
+	qsort(events, numEvents, sizeof(EVENT), compareEvents);
+	in1 = calloc(numEvents + 1, sizeof(FRAME));
+	in2 = calloc(numEvents + 1, sizeof(FRAME));
+	unsigned long long free1 = 0, free2 = 0;
+	for(unsigned long i=0; i<numEvents; ++i)
+	{
+		if(EV_IN1 == events[i].type)
+		{
+			unsigned long long s = events[i].cycle > free1 ? events[i].cycle : free1;
+			in1[numIn1].start = s;
+			in1[numIn1++].b = events[i].value;
+			free1 = s + MIDI_BYTE_CYCLES;
+		}
+		else if(EV_IN2 == events[i].type)
+		{
+			unsigned long long s = events[i].cycle > free2 ? events[i].cycle : free2;
+			in2[numIn2].start = s;
+			in2[numIn2++].b = events[i].value;
+			free2 = s + MIDI_BYTE_CYCLES;
+		}
+	}
+}
+
+////////////////////////////////////////////////////////////
+// REPORT
+static void histAdd(unsigned long *hist, unsigned long us)
+{
+	int bin = 0;
+	us >>= 6;
+	while(us && bin < HIST_BINS - 1)
+	{
+		++bin;
+		us >>= 1;
+	}
+	++hist[bin];
+}
+
+static void histPrint(const unsigned long *hist)
+{
+	static const char *names[HIST_BINS] = { "<64", "<128", "<256", "<512", "<1024", "<2048", "<4096", ">=4096" };
+	printf("    us:");
+	for(int i=0; i<HIST_BINS; ++i)
+		printf(" %s:%lu", names[i], hist[i]);
+	printf("\n");
+}
+
+static void report(const char *path)
+{
+	printf("trace %s: %.1f ms simulated\n", path, (double)simCycle / CYCLES_PER_MS);
+	printf("  bytes in: %lu main, %lu second; bytes out: %lu\n", numIn1, numIn2, numOut);
+
+	// clock jitter, from the start of each F8 sent. Intervals
+	// across a START, CONTINUE or STOP don't count
+	unsigned long ticks = 0;
+	double sum = 0, sumSq = 0, lo = 0, hi = 0;
+	unsigned long long last = 0;
+	for(unsigned long i=0; i<numOut; ++i)
+	{
+		if(0xFA == out[i].b || 0xFB == out[i].b || 0xFC == out[i].b)
+			last = 0;
+		if(0xF8 != out[i].b)
+			continue;
+		if(last)
+		{
+			double us = (double)(out[i].start - last) / CYCLES_PER_US;
+			if(!ticks || us < lo) lo = us;
+			if(!ticks || us > hi) hi = us;
+			sum += us;
+			sumSq += us * us;
+			++ticks;
+		}
+		last = out[i].start;
+	}
+	if(ticks)
+	{
+		double mean = sum / ticks;
+		double sd = sqrt(sumSq / ticks - mean * mean > 0 ? sumSq / ticks - mean * mean : 0);
+		printf("  clock: %lu intervals, mean %.1f us, min %.1f, max %.1f, jitter (max-min) %.1f, sd %.2f\n",
+			ticks, mean, lo, hi, hi - lo, sd);
+	}
+	else
+		printf("  clock: no F8 sent\n");
+
+	// thru latency. Each byte sent (other than clock and active
+	// sensing) is matched to the earliest byte of the same value
+	// at either input after the last one matched at that input
+	unsigned long hist[HIST_BINS] = { 0 };
+	unsigned long matched = 0;
+	double latSum = 0, latLo = 0, latHi = 0;
+	unsigned long p1 = 0, p2 = 0;
+	for(unsigned long i=0; i<numOut; ++i)
+	{
+		unsigned char b = out[i].b;
+		if(0xF8 == b || 0xFE == b)
+			continue;
+		FRAME *best = NULL;
+		unsigned long *bestPos = NULL;
+		for(int which=0; which<2; ++which)
+		{
+			FRAME *in = which ? in2 : in1;
+			unsigned long n = which ? numIn2 : numIn1;
+			unsigned long *pos = which ? &p2 : &p1;
+			while(*pos < n && in[*pos].start + RCIF_CYCLES + LATENCY_WINDOW < out[i].start)
+				++*pos;
+			for(unsigned long j=*pos; j<n && in[j].start + RCIF_CYCLES <= out[i].start; ++j)
+			{
+				if(in[j].b == b)
+				{
+					if(!best || in[j].start < best->start)
+					{
+						best = &in[j];
+						bestPos = pos;
+					}
+					break;
+				}
+			}
+		}
+		if(best)
+		{
+			// each input goes out in order, so anything at that
+			// input before this byte was not passed on
+			best->matched = 1;
+			*bestPos = (best - (bestPos == &p2 ? in2 : in1)) + 1;
+			double us = (double)(out[i].start - (best->start + RCIF_CYCLES)) / CYCLES_PER_US;
+			if(!matched || us < latLo) latLo = us;
+			if(!matched || us > latHi) latHi = us;
+			latSum += us;
+			++matched;
+			histAdd(hist, (unsigned long)us);
+		}
+	}
+	unsigned long unmatched = 0;
+	for(unsigned long j=0; j<numIn1; ++j)
+		if(!in1[j].matched && 0xF8 != in1[j].b && 0xFE != in1[j].b) ++unmatched;
+	for(unsigned long j=0; j<numIn2; ++j)
+		if(!in2[j].matched && 0xF8 != in2[j].b && 0xFE != in2[j].b) ++unmatched;
+	if(matched)
+	{
+		printf("  thru latency: %lu bytes, mean %.1f us, min %.1f, max %.1f\n",
+			matched, latSum / matched, latLo, latHi);
+		histPrint(hist);
+	}
+	else
+		printf("  thru latency: no bytes passed through\n");
+	printf("  input bytes not passed on (filtered, thinned or lost): %lu\n", unmatched);
+
+	// what the firmware counted
+	printf("  firmware: rxDropCount %u, txDropCount %u, rxOverrunCount %u, sysexAbortCount %u\n",
+		rxDropCount, txDropCount, rxOverrunCount, sysexAbortCount);
+	printf("  firmware: mode %u, tempo %d.%d BPM at the end\n", _mode, _bpm / 10, _bpm % 10);
+	printf("  simulator: EUSART overruns %lu, TXREG overwritten %lu, GIE set in ISR %lu, EEPROM writes %lu\n",
+		statRxOverrun, statTxOverwrite, statGieInIsr, statEepromWrites);
+	if(numIn2)
+		printf("  second input: samples up to %lu cycles late, %lu half a bit or more late\n",
+			statSampleLate, statSampleMissed);
+	printf("  ISR: %lu passes, %.1f%% of the CPU with the modelled costs\n",
+		statIsrPasses, simCycle ? 100.0 * statIsrCycles / simCycle : 0.0);
+	printf("    flags raised:");
+	for(int i=0; i<NUM_SRC; ++i)
+		printf(" %s:%lu", srcNames[i], statSrc[i]);
+	printf("\n    passes serving:");
+	for(int i=0; i<NUM_SRC; ++i)
+		printf(" %s:%lu", srcNames[i], statIsrSrc[i]);
+	printf("\n");
+}
+
+static void dumpOutput(const char *path)
+{
+	FILE *f = fopen(path, "w");
+	if(!f)
+	{
+		perror(path);
+		return;
+	}
+	for(unsigned long i=0; i<numOut; ++i)
+		fprintf(f, "%.3f %02X\n", (double)out[i].start / CYCLES_PER_MS, out[i].b);
+	fclose(f);
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"usage: midihub_sim [options] <trace>\n"
+		"  -t ms      stop after this long (default: end of trace + 500ms)\n"
+		"  -o hex     _options at boot\n"
+		"  -O hex     _options2 at boot\n"
+		"  -b bpm     tempo at boot, in tenths of a BPM\n"
+		"  -m mode    _mode at boot\n"
+		"  -r ratio   clock ratio at boot\n"
+		"  -q cycles  main loop cycles each time it enables interrupts (%u)\n"
+		"  -l cycles  cycles from an interrupt to the ISR body (%u)\n"
+		"  -i percent scale the modelled ISR costs (%u)\n"
+		"  -w file    write each byte sent, with its time in ms\n",
+		simMainQuantum, simIsrLatency, simIsrScale);
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	const char *path = NULL;
+	double stopMs = -1;
+	for(int i=1; i<argc; ++i)
+	{
+		if('-' == argv[i][0] && i + 1 < argc)
+		{
+			char *v = argv[++i];
+			switch(argv[i - 1][1])
+			{
+				case 't': stopMs = atof(v); break;
+				case 'o': optOptions = strtol(v, NULL, 16); break;
+				case 'O': optOptions2 = strtol(v, NULL, 16); break;
+				case 'b': optBPM = atoi(v); break;
+				case 'm': optMode = atoi(v); break;
+				case 'r': optRatio = atoi(v); break;
+				case 'q': simMainQuantum = atoi(v); break;
+				case 'l': simIsrLatency = atoi(v); break;
+				case 'i': simIsrScale = atoi(v); break;
+				case 'w': optDump = v; break;
+				default: usage();
+			}
+		}
+		else if('-' != argv[i][0] && !path)
+			path = argv[i];
+		else
+			usage();
+	}
+	if(!path)
+		usage();
+
+	loadTrace(path);
+	simEndCycle = stopMs >= 0 ? (unsigned long long)(stopMs * CYCLES_PER_MS) : traceEnd;
+	memset(simEeprom, 0xFF, sizeof(simEeprom));
+	porta = 0x38;
+	SIM_BIT(portc, 3) = 1;
+
+	if(!setjmp(simDone))
+		firmware_main();
+
+	report(path);
+	if(optDump)
+		dumpOutput(optDump);
+	return (statTxOverwrite || statGieInIsr) ? 1 : 0;
+}
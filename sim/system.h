@@ -0,0 +1,44 @@
+// Host build of MidiHub.c
+// Stands in for the SourceBoost system.h. The PIC16F1825 special
+// function registers the firmware uses are plain bytes here, and
+// sim.c plays the part of the peripherals around them.
+// host.sed rewrites reg.N bit access to SIM_BIT(reg, N), txreg
+// writes to simTx(), timer 0 writes to simWriteTmr0(), clearing
+// CREN to simResetReceiver() and enabling interrupts to
+// simEnableInterrupts()
+
+#ifndef SIM_SYSTEM_H
+#define SIM_SYSTEM_H
+
+struct sim_bits {
+	unsigned char b0:1, b1:1, b2:1, b3:1, b4:1, b5:1, b6:1, b7:1;
+};
+#define SIM_BIT(r, n) (((volatile struct sim_bits *)&(r))->b##n)
+
+#define SIM_REG(r) volatile unsigned char r;
+SIM_REG(porta) SIM_REG(portc) SIM_REG(trisa) SIM_REG(trisc)
+SIM_REG(ansela) SIM_REG(anselc) SIM_REG(wpua) SIM_REG(osccon)
+SIM_REG(intcon) SIM_REG(option_reg)
+SIM_REG(pir1) SIM_REG(pir2) SIM_REG(pir3) SIM_REG(pie1) SIM_REG(pie2) SIM_REG(pie3)
+SIM_REG(tmr0) SIM_REG(tmr1l) SIM_REG(tmr1h) SIM_REG(t1con)
+SIM_REG(tmr2) SIM_REG(pr2) SIM_REG(t2con) SIM_REG(tmr4) SIM_REG(pr4) SIM_REG(t4con)
+SIM_REG(ccp1con) SIM_REG(ccpr1l) SIM_REG(ccpr1h) SIM_REG(ccp2con) SIM_REG(ccpr2l) SIM_REG(ccpr2h)
+SIM_REG(txsta) SIM_REG(rcsta) SIM_REG(baudcon) SIM_REG(spbrg) SIM_REG(spbrgh)
+SIM_REG(eeadrl) SIM_REG(eedatl) SIM_REG(eecon1) SIM_REG(eecon2)
+SIM_REG(iocap) SIM_REG(iocan) SIM_REG(iocaf)
+
+// EUSART data registers
+unsigned char simRx(void);
+void simTx(unsigned char b);
+void simResetReceiver(void);
+void simWriteTmr0(unsigned char v);
+#define rcreg simRx()
+
+// lets time pass inside the ISR (see sim.c)
+void simIsrPoint(void);
+
+// setting GIE. This is where interrupts get delivered, and
+// where simulated time passes for the main loop
+void simEnableInterrupts(void);
+
+#endif